@@ -0,0 +1,129 @@
+/**
+ * @file arena.c
+ * @author Mathieu Fourcroy
+ * @date 10/26
+ * @brief Contains the memory arena the buffers of a job are taken from.
+ *
+ * Every buffer of a job (pixels, training buffers, palette) is carved out of a
+ * single block allocated up front, so the memory used by a job is bounded by
+ * the size of its arena and everything is released at once, error paths
+ * included.
+ *
+ * The functions taking an arena also accept NULL, in which case they fall
+ * back to the heap. This way the same code serves the jobs which use an arena
+ * and the ones (server workers, cached palettes) whose buffers outlive a job.
+ */
+
+/*=====| INCLUDES |===========================================================*/
+#include <string.h>
+#include "arena.h"
+
+/*=====| FUNCTIONS |==========================================================*/
+/** Allocate the memory block of an arena.
+ *
+ * @param[out] a    The arena. It must be released with arena_release().
+ * @param[in]  size The size of the block, which is the maximum amount of 
+ *  memory the arena can hand out.
+ *
+ * @return 0 if everything goes right or -1 if the block can not be allocated.
+ */
+int arena_init(arena *a, size_t size){
+    void *base;
+
+    memset(a, 0, sizeof(arena));
+    if(posix_memalign(&base, ARENA_ALIGN, size) != 0){
+        return -1;
+    }
+    a->base = base;
+    a->size = size;
+    return 0;
+}
+
+/** Release an arena and every buffer taken from it.
+ *
+ * @param[in,out] a The arena initialized by arena_init().
+ */
+void arena_release(arena *a){
+    free(a->base);
+    memset(a, 0, sizeof(arena));
+}
+
+/** Take an ARENA_ALIGN aligned buffer from an arena.
+ *
+ * Like malloc(), the buffer is not initialized: the pages of a big buffer the
+ * caller only partly uses are never touched.
+ *
+ * This function can be called by several threads at the same time.
+ *
+ * @param[in,out] a    The arena, or NULL to allocate on the heap.
+ * @param[in]     size The size of the buffer.
+ *
+ * @return The buffer or NULL if the arena (or the heap) is exhausted.
+ */
+void *arena_alloc(arena *a, size_t size){
+    size_t offset;
+    size_t peak;
+    void *ptr;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if(a == NULL){
+        if(posix_memalign(&ptr, ARENA_ALIGN, size > 0 ? size : 1) != 0){
+            return NULL;
+        }
+    }
+    else{
+        /* Only move 'used' if the buffer fits, so it never exceeds 'size' */
+        offset = __atomic_load_n(&a->used, __ATOMIC_RELAXED);
+        do{
+            if(size > a->size - offset){
+                return NULL;
+            }
+        }while(!__atomic_compare_exchange_n(&a->used, &offset, offset + size,
+                                            1, __ATOMIC_RELAXED, 
+                                            __ATOMIC_RELAXED));
+        ptr = a->base + offset;
+        peak = __atomic_load_n(&a->peak, __ATOMIC_RELAXED);
+        while(offset + size > peak && 
+              !__atomic_compare_exchange_n(&a->peak, &peak, offset + size, 1,
+                                           __ATOMIC_RELAXED, 
+                                           __ATOMIC_RELAXED)){
+            // 'peak' was reloaded by the failed exchange: try again
+        }
+    }
+    return ptr;
+}
+
+/** Give back a buffer taken with arena_alloc().
+ *
+ * Buffers taken from an arena are only released with the arena (or with
+ * arena_reset()), so this only frees heap buffers.
+ *
+ * @param[in] a   The arena the buffer was taken from, or NULL.
+ * @param[in] ptr The buffer.
+ */
+void arena_free(arena *a, void *ptr){
+    if(a == NULL){
+        free(ptr);
+    }
+}
+
+/** Returns the current position of an arena, to be given to arena_reset().
+ *
+ * @param[in] a The arena.
+ *
+ * @return The position.
+ */
+size_t arena_mark(arena *a){
+    return a->used;
+}
+
+/** Release every buffer taken from an arena since a given position.
+ *
+ * @warning No other thread may use the arena meanwhile.
+ *
+ * @param[in,out] a    The arena.
+ * @param[in]     mark The position returned by arena_mark().
+ */
+void arena_reset(arena *a, size_t mark){
+    a->used = mark;
+}
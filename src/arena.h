@@ -0,0 +1,28 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+/*====| INCLUDES |============================================================*/
+#include <stdlib.h>
+
+/*====| DEFINES |=============================================================*/
+#define ARENA_ALIGN 16  // Alignment of every allocation (see PIX_ALIGN)
+
+/*====| TYPES |===============================================================*/
+/** A memory arena: a single block which is handed out piece by piece and
+ * released in one operation. */
+typedef struct{
+    unsigned char *base;    // The memory block
+    size_t size;            // Size of the block
+    size_t used;            // Bytes handed out so far
+    size_t peak;            // Highest value of 'used'
+} arena;
+
+/*====| PROTOTYPES |==========================================================*/
+int arena_init(arena *a, size_t size);
+void arena_release(arena *a);
+void *arena_alloc(arena *a, size_t size);
+void arena_free(arena *a, void *ptr);
+size_t arena_mark(arena *a);
+void arena_reset(arena *a, size_t mark);
+
+#endif
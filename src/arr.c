@@ -7,26 +7,12 @@
  */
 
 /*=====| INCLUDES |===========================================================*/
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 #include "arr.h"
 
 /*=====| FUNCTIONS |==========================================================*/
-/** Subtract a given float to every elements of a float array.
- *
- * @param[out] dst  The destination array which will contains the resulting  
- *  values. It must be of same size as 'src'.
- * @param[in]  src  The source array from which the results will be computed.
- * @param[in]  size The size of the 'dst' and 'src' arrays.
- * @param[in]  f    The float number which will be subtract to every elements of
- *  the 'src' array.
- */
-void arr_sub(float *dst, float *src, size_t size, float f){
-    size_t i;
-
-    for(i = 0; i < size; i++){
-        dst[i] = pow(src[i] - f, 2);
-    }
-}
-
 /** Compute the sum of two arrays.
  *
  * @warning The content of the 'dst' array will be modified to contains
@@ -101,27 +87,293 @@ size_t arr_min_idx(const float *arr, size_t size){
     return idx;
 }
 
-/** Flatten a 2D array and modify the given image data.
+/** Allocate an aligned array of RGBA vectors.
+ *
+ * Every vector starts on a PIX_ALIGN boundary so that it can be loaded in a
+ * single 128-bit SIMD register. The array must be released with arena_free().
+ *
+ * @param[in,out] mem   The arena to take the array from, or NULL for the 
+ *  heap.
+ * @param[in]     count The number of vectors (pixels or neurons) of the array.
+ *
+ * @return The array of 'count' * PIX_CHANNELS floats, or NULL if the 
+ *  allocation fail. Like malloc(), the floats are not initialized.
+ */
+float *arr_alloc_vec4(arena *mem, size_t count){
+    return arena_alloc(mem, sizeof(float) * PIX_CHANNELS * count);
+}
+
+/** Compute the squared euclidian distance between two RGBA vectors.
+ *
+ * @see https://en.wikipedia.org/wiki/Euclidean_distance.
+ *
+ * The square root is not taken: the distance is only used to compare vectors
+ * together and the square function is monotonic.
+ *
+ * @note Both vectors must be aligned on PIX_ALIGN (see arr_alloc_vec4()).
+ *
+ * @param[in] a The first vector.
+ * @param[in] b The second vector.
+ *
+ * @return The squared distance between 'a' and 'b'.
+ */
+float vec4_dist(const float *a, const float *b){
+#ifdef __SSE__
+    __m128 d = _mm_sub_ps(_mm_load_ps(a), _mm_load_ps(b));
+    __m128 shuf;
+
+    d = _mm_mul_ps(d, d);
+    shuf = _mm_shuffle_ps(d, d, _MM_SHUFFLE(2, 3, 0, 1));
+    d = _mm_add_ps(d, shuf);
+    shuf = _mm_movehl_ps(shuf, d);
+    d = _mm_add_ss(d, shuf);
+    return _mm_cvtss_f32(d);
+#else
+    float d0 = a[0] - b[0];
+    float d1 = a[1] - b[1];
+    float d2 = a[2] - b[2];
+    float d3 = a[3] - b[3];
+
+    return d0 * d0 + d1 * d1 + d2 * d2 + d3 * d3;
+#endif
+}
+
+/** Find and returns the index of the vector which is the nearest of 'v'.
+ *
+ * @param[in] vecs  The array of RGBA vectors (for instance the SOM weights).
+ * @param[in] count The number of vectors of 'vecs'.
+ * @param[in] v     The RGBA vector to compare to.
+ *
+ * @return The index of the vector of 'vecs' closest to 'v'.
+ */
+size_t arr_nearest(const float *vecs, size_t count, const float *v){
+    size_t i;
+    size_t idx = 0;
+    float minimum = vec4_dist(vecs, v);
+    float d;
+
+    for(i = 1; i < count; i++){
+        d = vec4_dist(&vecs[i * PIX_CHANNELS], v);
+        if(minimum > d){
+            minimum = d;
+            idx = i;
+        }
+    }
+    return idx;
+}
+
+/** Convert a 8 bits pixel into a premultiplied RGBA vector.
+ *
+ * @param[out] px       The RGBA vector.
+ * @param[in]  p        The pixel channels values.
+ * @param[in]  channels The number of channels of the pixel (1, 3 or 4).
+ * @param[in]  bgr      Whether the channels are in BGR(A) order (OpenCV) or
+ *  in RGB(A) order.
+ */
+static void pixel_load(float *px, const uchar *p, int channels, int bgr){
+    if(channels < 3){
+        px[0] = px[1] = px[2] = p[0] / 255.;
+    }
+    else{
+        px[0] = p[bgr ? 2 : 0] / 255.;
+        px[1] = p[1] / 255.;
+        px[2] = p[bgr ? 0 : 2] / 255.;
+    }
+    px[3] = channels == 4 ? p[3] / 255. : 1.;
+    px[0] *= px[3];
+    px[1] *= px[3];
+    px[2] *= px[3];
+}
+
+/** Convert a premultiplied RGBA vector into a 8 bits pixel.
+ *
+ * This is the reverse operation of pixel_load(): the colors are divided by
+ * the alpha channel and the channels the pixel does not have are dropped.
+ *
+ * @param[out] p        The pixel channels values.
+ * @param[in]  px       The RGBA vector.
+ * @param[in]  channels The number of channels of the pixel (1, 3 or 4).
+ * @param[in]  bgr      Whether the channels are in BGR(A) order (OpenCV) or
+ *  in RGB(A) order.
+ */
+static void pixel_store(uchar *p, const float *px, int channels, int bgr){
+    float rgba[PIX_CHANNELS];
+    float a = px[3] > 0 ? px[3] : 1.;
+    int k;
+
+    for(k = 0; k < PIX_CHANNELS; k++){
+        rgba[k] = k < 3 ? px[k] / a : px[k];
+        rgba[k] = rgba[k] < 0 ? 0 : rgba[k] > 1 ? 1 : rgba[k];
+    }
+    if(channels < 3){
+        p[0] = (uchar)(rgba[0] * 255. + .5);
+        return;
+    }
+    p[bgr ? 2 : 0] = (uchar)(rgba[0] * 255. + .5);
+    p[1] = (uchar)(rgba[1] * 255. + .5);
+    p[bgr ? 0 : 2] = (uchar)(rgba[2] * 255. + .5);
+    if(channels == 4){
+        p[3] = (uchar)(rgba[3] * 255. + .5);
+    }
+}
+
+/** Fill an array of RGBA vectors with the data of an image.
+ *
+ * The pixels are stored row by row. The channels are normalized in [0, 1] and
+ * the colors are premultiplied by the alpha channel so that fully transparent
+ * pixels are all the same whatever their color. Images without alpha channel
+ * are opaque (alpha is 1) and grayscale images have R = G = B.
+ *
+ * Only a band of rows can be loaded, so that a big image can be processed a
+ * tile at a time.
+ *
+ * @param[out] arr      The array of nbRows * width RGBA vectors.
+ * @param[in]  img      The 8 bits image (1, 3 or 4 channels).
+ * @param[in]  firstRow The first row to load.
+ * @param[in]  nbRows   The number of rows to load (img->height for the 
+ *  whole image).
+ */
+void arr_from_IplImage(float *arr, const IplImage *img, int firstRow, 
+                       int nbRows){
+    int i, j;
+
+    for(j = firstRow; j < firstRow + nbRows; j++){
+        for(i = 0; i < img->width; i++){
+            pixel_load(&arr[((j - firstRow) * img->width + i) * PIX_CHANNELS],
+                       &CV_IMAGE_ELEM(img, uchar, j, i * img->nChannels),
+                       img->nChannels, 1);
+        }
+    }
+}
+
+/** Modify the given image data with an array of RGBA vectors.
+ *
+ * This is the reverse operation of arr_from_IplImage(): the colors are
+ * divided by the alpha channel and the channels the image does not have are
+ * dropped.
  *
  * @param[in,out] img      The image wich will be modified with the data of 
  *  'arr'.
- * @param[in]     arr      The 2D array containing the posterized pixels.
- * @param[in]     height   The image height.
- * @param[in]     width    The image width.
- * @param[in]     channels The number of channels of the image.
+ * @param[in]     arr      The array of nbRows * width premultiplied RGBA 
+ *  vectors.
+ * @param[in]     firstRow The first row to modify.
+ * @param[in]     nbRows   The number of rows to modify (img->height for the 
+ *  whole image).
  */
-void arr_to_IplImage(IplImage *img, float **arr, int height, int width,
-                     int channels){
+void arr_to_IplImage(IplImage *img, const float *arr, int firstRow, 
+                     int nbRows){
     int i, j;
 
-    for(i = 0; i < width; i++){
-        for(j = 0; j < height; j++){
-            CV_IMAGE_ELEM(img, uchar, j, i * 3 + 2) =\
-                (uchar)(arr[i * height + j][0]);
-            CV_IMAGE_ELEM(img, uchar, j, i * 3 + 1) =\
-                (uchar)(arr[i * height + j][1]);
-            CV_IMAGE_ELEM(img, uchar, j, i * 3 + 0) =\
-                (uchar)(arr[i * height + j][2]);
+    for(j = firstRow; j < firstRow + nbRows; j++){
+        for(i = 0; i < img->width; i++){
+            pixel_store(&CV_IMAGE_ELEM(img, uchar, j, i * img->nChannels),
+                        &arr[((j - firstRow) * img->width + i) * 
+                             PIX_CHANNELS],
+                        img->nChannels, 1);
         }
     }
 }
+
+/** Fill an array of RGBA vectors with a subsample of the pixels of an image.
+ *
+ * The pixels are picked at regular intervals (in row order) over the whole
+ * image. See arr_from_IplImage() for the conversion.
+ *
+ * @param[out] arr   The array of 'count' RGBA vectors.
+ * @param[in]  img   The 8 bits image (1, 3 or 4 channels).
+ * @param[in]  count The number of pixels to pick. It must not be greater than
+ *  the number of pixels of the image.
+ */
+void arr_sample_IplImage(float *arr, const IplImage *img, size_t count){
+    size_t nbPixels = (size_t)img->width * img->height;
+    size_t i, idx;
+
+    for(i = 0; i < count; i++){
+        idx = i * nbPixels / count;
+        pixel_load(&arr[i * PIX_CHANNELS],
+                   &CV_IMAGE_ELEM(img, uchar, idx / img->width, 
+                                  (idx % img->width) * img->nChannels),
+                   img->nChannels, 1);
+    }
+}
+
+/** Convert an image to 8 bits per channel.
+ *
+ * cvLoadImage() keeps the depth of the file with CV_LOAD_IMAGE_UNCHANGED, so
+ * a 16 bits PNG or TIFF gives a 16 bits image. Its channels are scaled down
+ * to 8 bits, the full range of the depth (or [0, 1] for floating point 
+ * images) being mapped to [0, 255].
+ *
+ * @param[in] img The image, released if it is converted. Can be NULL.
+ *
+ * @return The 8 bits image ('img' itself if it is one already) or NULL if 
+ *  'img' is NULL or the conversion fail.
+ */
+IplImage *arr_IplImage_8U(IplImage *img){
+    IplImage *conv;
+    double scale;
+
+    if(img == NULL || img->depth == IPL_DEPTH_8U){
+        return img;
+    }
+    switch(img->depth){
+        case IPL_DEPTH_8S:
+            scale = 255. / 127;
+            break;
+        case IPL_DEPTH_16U:
+            scale = 255. / 65535;
+            break;
+        case IPL_DEPTH_16S:
+            scale = 255. / 32767;
+            break;
+        case IPL_DEPTH_32S:
+            scale = 255. / 2147483647;
+            break;
+        default:                // IPL_DEPTH_32F and IPL_DEPTH_64F
+            scale = 255.;
+            break;
+    }
+    conv = cvCreateImage(cvGetSize(img), IPL_DEPTH_8U, img->nChannels);
+    if(conv != NULL){
+        cvConvertScale(img, conv, scale, 0);
+    }
+    cvReleaseImage(&img);
+    return conv;
+}
+
+/** Fill an array of RGBA vectors with raw interleaved pixels.
+ *
+ * Same as arr_from_IplImage() for pixels which are not held by an OpenCV
+ * image: 'count' pixels of 'channels' bytes each, in gray, RGB or RGBA order.
+ *
+ * @param[out] arr      The array of 'count' RGBA vectors.
+ * @param[in]  data     The raw pixels.
+ * @param[in]  count    The number of pixels.
+ * @param[in]  channels The number of channels of a pixel (1, 3 or 4).
+ */
+void arr_from_bytes(float *arr, const unsigned char *data, size_t count,
+                    int channels){
+    size_t i;
+
+    for(i = 0; i < count; i++){
+        pixel_load(&arr[i * PIX_CHANNELS], &data[i * channels], channels, 0);
+    }
+}
+
+/** Convert an array of RGBA vectors into raw interleaved pixels.
+ *
+ * This is the reverse operation of arr_from_bytes().
+ *
+ * @param[out] data     The raw pixels ('count' * 'channels' bytes).
+ * @param[in]  arr      The array of 'count' premultiplied RGBA vectors.
+ * @param[in]  count    The number of pixels.
+ * @param[in]  channels The number of channels of a pixel (1, 3 or 4).
+ */
+void arr_to_bytes(unsigned char *data, const float *arr, size_t count,
+                  int channels){
+    size_t i;
+
+    for(i = 0; i < count; i++){
+        pixel_store(&data[i * channels], &arr[i * PIX_CHANNELS], channels, 0);
+    }
+}
@@ -3,14 +3,29 @@
 
 /*====| INCLUDES |============================================================*/
 #include <opencv/cv.h>
+#include "arena.h"
+
+/*====| DEFINES |=============================================================*/
+#define PIX_CHANNELS 4  // Pixels and weights are stored as RGBA vectors
+#define PIX_ALIGN 16    // Alignment of a 4 floats (128 bits) vector
 
 /*====| PROTOTYPES |==========================================================*/
-void arr_sub(float *dst, float *src, size_t size, float f);
 void arr_add(float dst[], float src[], size_t size);
 void arr_abs(float *dst, float *src, size_t size);
 float arr_sum(float *arr, size_t size);
 size_t arr_min_idx(const float *arr, size_t size);
-void arr_to_IplImage(IplImage *img, float **arr, int height, int width,
-                     int channels);
+float *arr_alloc_vec4(arena *mem, size_t count);
+float vec4_dist(const float *a, const float *b);
+size_t arr_nearest(const float *vecs, size_t count, const float *v);
+void arr_from_IplImage(float *arr, const IplImage *img, int firstRow, 
+                       int nbRows);
+void arr_to_IplImage(IplImage *img, const float *arr, int firstRow, 
+                     int nbRows);
+void arr_sample_IplImage(float *arr, const IplImage *img, size_t count);
+IplImage *arr_IplImage_8U(IplImage *img);
+void arr_from_bytes(float *arr, const unsigned char *data, size_t count,
+                    int channels);
+void arr_to_bytes(unsigned char *data, const float *arr, size_t count,
+                  int channels);
 
-#endif
\ No newline at end of file
+#endif
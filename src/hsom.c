@@ -0,0 +1,316 @@
+/**
+ * @file hsom.c
+ * @author Mathieu Fourcroy
+ * @date 10/26
+ * @brief Contains functions about the hierarchical (tree-structured) self
+ *  organized map used for large palettes.
+ *
+ * With a flat SOM, finding the Best Matching Unit of a pixel costs one
+ * distance per neuron. Here a coarse top level map splits the colors space and
+ * each of its neurons owns a child map trained only on the pixels it matches.
+ * Finding the BMU descends the tree: it costs top + child neurons distances
+ * (about twice the square root of the number of neurons) instead of
+ * top * child. The descent may miss the true BMU when it lies in another child
+ * map, the resulting quality loss is given by the quantization error.
+ */
+
+/*=====| INCLUDES |===========================================================*/
+#include <string.h>
+#include <math.h>
+#include "hsom.h"
+#include "arr.h"
+#include "util.h"
+
+/*=====| DEFINES |============================================================*/
+#define HSOM_MIN_EPOCHS 100 // Minimum number of iterations of a child map
+#define HSOM_STRIDE 7919    // Pixels visiting order when grouping (a prime)
+#define HSOM_CLOCK_EVERY 4096 // Pixels grouped between two reads of the clock
+
+/*=====| FUNCTIONS |==========================================================*/
+/** Split a posterization level into the levels of a hierarchical SOM.
+ *
+ * The posterization level L (L^2 colors) is split in a top level T and a
+ * child level C with T * C = L when possible (T being the largest divisor of
+ * L not greater than its square root). Otherwise T is the square root of L
+ * and C is rounded up, so the palette has (T * C)^2 colors instead of L^2: 
+ * 64 instead of 49 for L = 7, 400 instead of 289 for L = 17. The child maps
+ * are square SOM so they can not be trimmed to the exact count.
+ *
+ * @param[in]  postLevel  The posterization level.
+ * @param[out] topLevel   The level of the top map (T^2 neurons).
+ * @param[out] childLevel The level of the child maps (C^2 neurons each).
+ */
+void hsom_levels(int postLevel, int *topLevel, int *childLevel){
+    *topLevel = (int)sqrt(postLevel);
+    while(*topLevel > 1 && postLevel % *topLevel != 0){
+        (*topLevel)--;
+    }
+    if(*topLevel == 1){
+        *topLevel = max((int)sqrt(postLevel), 1);
+    }
+    *childLevel = (postLevel + *topLevel - 1) / *topLevel;
+}
+
+/** Compute the memory a hierarchical SOM and its training take.
+ *
+ * @param[in] postLevel The posterization level.
+ * @param[in] nbPixels  The number of pixels it is trained on.
+ *
+ * @return The size (in bytes) hsom_init() and hsom_train() take from their
+ *  arena, including the alignment of every buffer.
+ */
+size_t hsom_memory(int postLevel, unsigned int nbPixels){
+    int topLevel, childLevel, top, child;
+
+    hsom_levels(postLevel, &topLevel, &childLevel);
+    top = topLevel * topLevel;
+    child = childLevel * childLevel;
+    return sizeof(float) * PIX_CHANNELS * (top + top * child) +
+           sizeof(unsigned int) * 2 * top + 
+           (sizeof(unsigned int) + sizeof(float) * PIX_CHANNELS) * 
+           (size_t)nbPixels +
+           som_workspace_memory(max(top, child)) + 6 * ARENA_ALIGN;
+}
+
+/** Allocate a hierarchical SOM for a given posterization level.
+ *
+ * The levels of the maps are given by hsom_levels().
+ *
+ * @param[out]    h         The hierarchical SOM. It must be released with 
+ *  hsom_free().
+ * @param[in]     postLevel The posterization level.
+ * @param[in,out] mem       The arena to take the weight vectors from, or NULL
+ *  for the heap.
+ *
+ * @return SOM_OK if everything goes right or SOM_NO_MEMORY if a memory 
+ *  allocation (malloc) fail.
+ */
+int hsom_init(hsom *h, int postLevel, arena *mem){
+    int topLevel, childLevel;
+
+    hsom_levels(postLevel, &topLevel, &childLevel);
+    h->topNeurons = topLevel * topLevel;
+    h->childNeurons = childLevel * childLevel;
+    h->mem = mem;
+    h->top = arr_alloc_vec4(mem, h->topNeurons);
+    h->children = arr_alloc_vec4(mem, h->topNeurons * h->childNeurons);
+    if(h->top == NULL || h->children == NULL){
+        hsom_free(h);
+        return SOM_NO_MEMORY;
+    }
+    return SOM_OK;
+}
+
+/** Release a hierarchical SOM.
+ *
+ * @param[in,out] h The hierarchical SOM initialized by hsom_init().
+ */
+void hsom_free(hsom *h){
+    arena_free(h->mem, h->top);
+    arena_free(h->mem, h->children);
+    h->top = NULL;
+    h->children = NULL;
+}
+
+/** Find the Best Matching Unit of a vector by descending the tree.
+ *
+ * @param[in] h The trained hierarchical SOM.
+ * @param[in] v The RGBA vector.
+ *
+ * @return The index of the BMU in the palette ('h->children').
+ */
+size_t hsom_nearest(const hsom *h, const float *v){
+    size_t k = arr_nearest(h->top, h->topNeurons, v);
+    const float *child = &h->children[k * h->childNeurons * PIX_CHANNELS];
+
+    return k * h->childNeurons + arr_nearest(child, h->childNeurons, v);
+}
+
+/** Give back the temporary buffers of hsom_train().
+ *
+ * @param[in,out] mem    The arena the buffers were taken from, or NULL.
+ * @param[in]     mark   The arena position before the buffers were taken.
+ * @param[in]     count  The number of pixels of each child map.
+ * @param[in]     first  The index of the first pixel of each child map.
+ * @param[in]     bmu    The top level BMU of each pixel.
+ * @param[in]     sorted The pixels grouped by top level BMU.
+ * @param[in,out] ws     The training buffers.
+ */
+static void hsom_train_free(arena *mem, size_t mark, unsigned int *count,
+                            unsigned int *first, unsigned int *bmu, 
+                            float *sorted, som_workspace *ws){
+    if(mem != NULL){
+        arena_reset(mem, mark);
+        return;
+    }
+    free(count);
+    free(first);
+    free(bmu);
+    free(sorted);
+    som_workspace_free(ws);
+}
+
+/** Train a hierarchical SOM.
+ *
+ * The top level map is trained on every pixels with the given options. The
+ * pixels are then grouped by top level BMU and each child map is trained on
+ * its own group. The 'opts->noEpoch' iterations are shared between the child
+ * maps in proportion of their number of pixels (with a minimum of
+ * HSOM_MIN_EPOCHS each). A child map without any pixel is filled with the
+ * color of its parent neuron.
+ *
+ * If 'opts->deadline' is set, the time left is shared between the top level
+ * map (a third), the grouping and the child maps (half of the rest each). 
+ * The pixels are grouped in a scattered order (HSOM_STRIDE apart) so that,
+ * when the deadline of the grouping is reached, the child maps are still 
+ * trained on a regular subsample of the image.
+ *
+ * When the buffers are taken from an arena ('opts->mem'), the temporary ones
+ * are given back to it before returning.
+ *
+ * @param[in,out] h         The hierarchical SOM initialized by hsom_init().
+ * @param[in]     imgPixels The original image RGBA pixels.
+ * @param[in]     nbPixels  The number of pixels of th image (height * width).
+ * @param[in]     opts      The training options (see som_opts_init()).
+ * @param[out]    stats     The total number of iterations done and the 
+ *  quantization error of the whole tree. Can be NULL.
+ *
+ * @return SOM_OK if everything goes right or SOM_NO_MEMORY if a memory 
+ *  allocation (malloc) fail.
+ */
+int hsom_train(hsom *h, const float *imgPixels, unsigned int nbPixels,
+               const som_opts *opts, som_stats *stats){
+    som_opts childOpts = *opts;
+    size_t mark =               // Arena position before the temporary buffers
+        opts->mem != NULL ? arena_mark(opts->mem) : 0;
+    som_stats childStats;
+    som_workspace ws;
+    unsigned int *count;        // Number of pixels of each child map
+    unsigned int *first;        // Index of the first pixel of each child map
+    unsigned int *bmu;          // Top level BMU of each pixel
+    unsigned int seed = opts->seed;
+    float *sorted;              // Pixels grouped by top level BMU
+    float *child;
+    double qerror = 0.;
+    unsigned int done = 0;      // Number of pixels of the trained child maps
+    unsigned int nbGrouped;     // Number of pixels grouped
+    unsigned int stride =       // Distance between two pixels grouped in a row
+        nbPixels % HSOM_STRIDE != 0 ? HSOM_STRIDE : 1;
+    double deadline = 0;        // When the grouping must be done by
+    int epochs;
+    unsigned int i;
+    int k, j;
+
+    memset(&ws, 0, sizeof(som_workspace));
+    ws.mem = opts->mem;
+    count = arena_alloc(opts->mem, sizeof(unsigned int) * h->topNeurons);
+    first = arena_alloc(opts->mem, sizeof(unsigned int) * h->topNeurons);
+    bmu = arena_alloc(opts->mem, sizeof(unsigned int) * nbPixels);
+    sorted = arr_alloc_vec4(opts->mem, nbPixels);
+    if(count == NULL || first == NULL || bmu == NULL || sorted == NULL ||
+       som_workspace_init(&ws, max(h->topNeurons, h->childNeurons), 
+                          opts->mem) != SOM_OK){
+        hsom_train_free(opts->mem, mark, count, first, bmu, sorted, &ws);
+        return SOM_NO_MEMORY;
+    }
+    memset(count, 0, sizeof(unsigned int) * h->topNeurons);
+    memset(first, 0, sizeof(unsigned int) * h->topNeurons);
+
+    /* Train the top level map */
+    if(opts->deadline > 0){
+        childOpts.deadline = now_ms() + (opts->deadline - now_ms()) / 3;
+    }
+    som_train(h->top, imgPixels, nbPixels, h->topNeurons, &childOpts, &ws, 
+              &childStats);
+    epochs = childStats.epochs;
+
+    /* Group the pixels by top level BMU */
+    if(opts->deadline > 0){
+        deadline = now_ms() + (opts->deadline - now_ms()) / 2;
+    }
+    for(i = 0; i < nbPixels; i++){
+        if(deadline > 0 && i > 0 && i % HSOM_CLOCK_EVERY == 0 && 
+           now_ms() >= deadline){
+            break;
+        }
+        bmu[i] = arr_nearest(h->top, h->topNeurons, 
+            &imgPixels[(size_t)i * stride % nbPixels * PIX_CHANNELS]);
+        count[bmu[i]]++;
+    }
+    nbGrouped = i;
+    for(k = 1; k < h->topNeurons; k++){
+        first[k] = first[k - 1] + count[k - 1];
+    }
+    memset(count, 0, sizeof(unsigned int) * h->topNeurons);
+    for(i = 0; i < nbGrouped; i++){
+        memcpy(&sorted[(first[bmu[i]] + count[bmu[i]]) * PIX_CHANNELS],
+               &imgPixels[(size_t)i * stride % nbPixels * PIX_CHANNELS], 
+               sizeof(float) * PIX_CHANNELS);
+        count[bmu[i]]++;
+    }
+
+    /* Train the child maps */
+    for(k = 0; k < h->topNeurons; k++){
+        child = &h->children[k * h->childNeurons * PIX_CHANNELS];
+        if(count[k] == 0){
+            for(j = 0; j < h->childNeurons; j++){
+                memcpy(&child[j * PIX_CHANNELS], &h->top[k * PIX_CHANNELS],
+                       sizeof(float) * PIX_CHANNELS);
+            }
+            continue;
+        }
+        childOpts.noEpoch = max((int)((double)opts->noEpoch * count[k] / 
+                                      nbGrouped), HSOM_MIN_EPOCHS);
+        childOpts.seed = opts->seed + 7919 * (k + 1);
+        if(opts->deadline > 0){
+            /* Share the time left in proportion to the number of pixels */
+            childOpts.deadline = now_ms() + (opts->deadline - now_ms()) * 
+                                 count[k] / (nbGrouped - done);
+        }
+        done += count[k];
+        som_train(child, &sorted[first[k] * PIX_CHANNELS], count[k], 
+                  h->childNeurons, &childOpts, &ws, &childStats);
+        epochs += childStats.epochs;
+    }
+
+    if(stats != NULL){
+        for(i = 0; i < SOM_QE_SAMPLES; i++){
+            const float *px = 
+                &imgPixels[random_uint(nbPixels, &seed) * PIX_CHANNELS];
+
+            qerror += sqrt(vec4_dist(
+                &h->children[hsom_nearest(h, px) * PIX_CHANNELS], px));
+        }
+        stats->epochs = epochs;
+        stats->qerror = qerror / SOM_QE_SAMPLES;
+    }
+
+    hsom_train_free(opts->mem, mark, count, first, bmu, sorted, &ws);
+    return SOM_OK;
+}
+
+/** Posterize an image from a trained hierarchical SOM.
+ *
+ * Same as som_posterize() but the BMU of each pixel is found by descending
+ * the tree (see hsom_nearest()).
+ *
+ * @note 'postPixels' and 'origPixels' can be the same array.
+ *
+ * @param[out] postPixels The RGBA vectors wich will contains the posterized 
+ *                        pixels.
+ * @param[in]  origPixels The original image pixels.
+ * @param[in]  h          The trained hierarchical SOM.
+ * @param[in]  nbPixels   The number of pixels of th image (height * width).
+ */
+void hsom_posterize(float *postPixels, const float *origPixels, const hsom *h,
+                    unsigned int nbPixels){
+    unsigned int i;
+    size_t choosen;
+
+    for(i = 0; i < nbPixels; i++){
+        choosen = hsom_nearest(h, &origPixels[i * PIX_CHANNELS]);
+        memcpy(&postPixels[i * PIX_CHANNELS], 
+               &h->children[choosen * PIX_CHANNELS], 
+               sizeof(float) * PIX_CHANNELS);
+    }
+}
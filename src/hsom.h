@@ -0,0 +1,30 @@
+#ifndef _HSOM_H_
+#define _HSOM_H_
+
+/*====| INCLUDES |============================================================*/
+#include <stdlib.h>
+#include "som.h"
+
+/*====| TYPES |===============================================================*/
+/** A two levels (tree-structured) SOM. Each neuron of the top level map owns
+ * a child map, the child maps neurons make the palette. */
+typedef struct{
+    int topNeurons;     // Number of neurons of the top level map
+    int childNeurons;   // Number of neurons of each child map
+    arena *mem;         // Memory the weight vectors are taken from
+    float *top;         // Top level map RGBA weight vectors
+    float *children;    // Child maps RGBA weight vectors (the palette)
+} hsom;
+
+/*====| PROTOTYPES |==========================================================*/
+void hsom_levels(int postLevel, int *topLevel, int *childLevel);
+size_t hsom_memory(int postLevel, unsigned int nbPixels);
+int hsom_init(hsom *h, int postLevel, arena *mem);
+void hsom_free(hsom *h);
+int hsom_train(hsom *h, const float *imgPixels, unsigned int nbPixels,
+               const som_opts *opts, som_stats *stats);
+size_t hsom_nearest(const hsom *h, const float *v);
+void hsom_posterize(float *postPixels, const float *origPixels, const hsom *h,
+                    unsigned int nbPixels);
+
+#endif
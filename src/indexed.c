@@ -0,0 +1,541 @@
+/**
+ * @file indexed.c
+ * @author Mathieu Fourcroy
+ * @date 10/26
+ * @brief Contains functions to write a posterized image as palette indices:
+ *  an indexed PNG or a GIF.
+ *
+ * A posterization of at most INDEXED_MAX_COLORS colors (a flat SOM up to the
+ * level 16) can be written as one palette index per pixel instead of 
+ * truecolor pixels. The indices come straight from the colors lookup, are 
+ * kept on one byte each (see indexed_set()) and are packed at the smallest 
+ * bit depth the palette fits in (1, 2, 4 or 8 bits).
+ *
+ * The PNG files use the color type 3 (palette) with a PLTE chunk, plus a tRNS
+ * chunk when some colors are not opaque. The GIF files only have a binary
+ * transparency: the colors less opaque than INDEXED_GIF_ALPHA are all written
+ * with the index of the first of them, which is the transparent one.
+ */
+
+/*=====| INCLUDES |===========================================================*/
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+#include "indexed.h"
+#include "arr.h"
+#include "util.h"
+
+/*=====| TYPES |==============================================================*/
+/** The state of the GIF LZW encoder. */
+typedef struct{
+    FILE *f;                            // The output file
+    unsigned long acc;                  // Bits not written yet
+    int nbAcc;                          // Number of bits in acc
+    unsigned char block[255];           // The data sub-block being filled
+    int blockLen;                       // Number of bytes in block
+    int keys[INDEXED_LZW_HASH];         // Prefix and suffix of each string
+    short codes[INDEXED_LZW_HASH];      // Code of each string
+} gif_lzw;
+
+/*=====| FUNCTIONS |==========================================================*/
+/** Compute the memory an indexed image takes, up to its writing.
+ *
+ * @param[in] width  The width of the image.
+ * @param[in] height The height of the image.
+ *
+ * @return The size (in bytes) indexed_init() and indexed_write() take from
+ *  their arena.
+ */
+size_t indexed_memory(int width, int height){
+    size_t png =                // Packed row, IDAT chunk and deflate state
+        (size_t)width + 1 + INDEXED_PNG_CHUNK + INDEXED_ZLIB_MEMORY;
+
+    return INDEXED_MAX_COLORS * 4 + (size_t)width * height + 
+           max(png, sizeof(gif_lzw)) + 4 * ARENA_ALIGN;
+}
+
+/** Make an indexed image of the size of a posterized one.
+ *
+ * The colors are converted from the palette; the indices are left
+ * uninitialized (see indexed_set()).
+ *
+ * @param[out] img    The indexed image. It must be released with
+ *  indexed_free().
+ * @param[in]  pal    The palette (at most INDEXED_MAX_COLORS colors).
+ * @param[in]  width  The width of the image.
+ * @param[in]  height The height of the image.
+ * @param[in]  mem    The arena the buffers are taken from, also by 
+ *  indexed_write() (see indexed_memory()), or NULL for the heap.
+ *
+ * @return SOM_OK if everything goes right, -1 if the palette has too many
+ *  colors or SOM_NO_MEMORY if a memory allocation (malloc) fail.
+ */
+int indexed_init(indexed *img, const palette *pal, int width, int height, 
+                 arena *mem){
+    memset(img, 0, sizeof(indexed));
+    if(pal->nbColors > INDEXED_MAX_COLORS){
+        return -1;
+    }
+    img->width = width;
+    img->height = height;
+    img->nbColors = pal->nbColors;
+    img->mem = mem;
+    img->colors = arena_alloc(mem, (size_t)pal->nbColors * 4);
+    img->indices = arena_alloc(mem, (size_t)width * height);
+    if(img->colors == NULL || img->indices == NULL){
+        indexed_free(img);
+        return SOM_NO_MEMORY;
+    }
+    arr_to_bytes(img->colors, pal->colors, pal->nbColors, 4);
+    return SOM_OK;
+}
+
+/** Release an indexed image.
+ *
+ * @param[in,out] img The indexed image.
+ */
+void indexed_free(indexed *img){
+    arena_free(img->mem, img->colors);
+    arena_free(img->mem, img->indices);
+    memset(img, 0, sizeof(indexed));
+}
+
+/** Set the indices of consecutive pixels of an indexed image.
+ *
+ * @param[in,out] img       The indexed image.
+ * @param[in]     first     The position of the first pixel (row by row).
+ * @param[in]     indices   The palette indices of the pixels (see 
+ *  palette_index_parallel()), less than the number of colors.
+ * @param[in]     nbIndices The number of pixels.
+ */
+void indexed_set(indexed *img, size_t first, const unsigned int *indices,
+                 size_t nbIndices){
+    size_t i;
+
+    for(i = 0; i < nbIndices; i++){
+        img->indices[first + i] = (unsigned char)indices[i];
+    }
+}
+
+/** Compute the bit depth of the indices of a palette.
+ *
+ * @param[in] nbColors The number of colors of the palette.
+ *
+ * @return The smallest of 1, 2, 4 and 8 bits the indices fit in.
+ */
+int indexed_bits(int nbColors){
+    int bits = 1;
+
+    while(bits < 8 && nbColors > 1 << bits){
+        bits *= 2;
+    }
+    return bits;
+}
+
+/** Find the indexed format of a file from its extension.
+ *
+ * @param[in] path The path of the file.
+ *
+ * @return INDEXED_PNG, INDEXED_GIF or INDEXED_NONE if the file can not be
+ *  written as an indexed image.
+ */
+int indexed_format(const char *path){
+    const char *ext = get_filename_ext(path);
+
+    if(strcasecmp(ext, "png") == 0){
+        return INDEXED_PNG;
+    }
+    if(strcasecmp(ext, "gif") == 0){
+        return INDEXED_GIF;
+    }
+    return INDEXED_NONE;
+}
+
+/** Write a 32 bits big endian integer.
+ *
+ * @param[out] p The 4 bytes.
+ * @param[in]  v The integer.
+ */
+static void put_be32(unsigned char *p, unsigned long v){
+    p[0] = (v >> 24) & 0xff;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
+
+/** Write a PNG chunk: its length, type, data and CRC.
+ *
+ * @param[in] f    The file.
+ * @param[in] type The chunk type (4 letters).
+ * @param[in] data The chunk data.
+ * @param[in] len  The length of the data.
+ */
+static void png_chunk(FILE *f, const char *type, const unsigned char *data,
+                      size_t len){
+    unsigned char be[4];
+    uLong crc;
+
+    put_be32(be, len);
+    fwrite(be, 1, 4, f);
+    fwrite(type, 1, 4, f);
+    crc = crc32(0L, (const Bytef *)type, 4);
+    if(len > 0){
+        fwrite(data, 1, len, f);
+        crc = crc32(crc, data, len);
+    }
+    put_be32(be, crc);
+    fwrite(be, 1, 4, f);
+}
+
+/** Allocate the deflate state of zlib from the arena of an image.
+ *
+ * @param[in] opaque The arena (or NULL for the heap).
+ * @param[in] items  The number of items.
+ * @param[in] size   The size of an item.
+ *
+ * @return The buffer or Z_NULL if there is not enough memory.
+ */
+static voidpf png_zalloc(voidpf opaque, uInt items, uInt size){
+    return arena_alloc(opaque, (size_t)items * size);
+}
+
+/** Release a buffer of png_zalloc().
+ *
+ * @param[in] opaque The arena (or NULL for the heap).
+ * @param[in] ptr    The buffer.
+ */
+static void png_zfree(voidpf opaque, voidpf ptr){
+    arena_free(opaque, ptr);
+}
+
+/** Pack a row of indices at a given bit depth, the most significant bits
+ * first.
+ *
+ * @param[out] row   The packed row.
+ * @param[in]  idx   The indices of the row.
+ * @param[in]  width The number of indices.
+ * @param[in]  bits  The bit depth (1, 2, 4 or 8).
+ */
+static void png_pack(unsigned char *row, const unsigned char *idx, int width,
+                     int bits){
+    int x;
+
+    if(bits == 8){
+        memcpy(row, idx, width);
+        return;
+    }
+    memset(row, 0, ((size_t)width * bits + 7) / 8);
+    for(x = 0; x < width; x++){
+        row[x * bits / 8] |= idx[x] << (8 - bits - (x * bits) % 8);
+    }
+}
+
+/** Write an indexed image as a palette PNG.
+ *
+ * The rows are packed at indexed_bits() per pixel with no filter (the 
+ * recommended filter of palette images). They are compressed one at a time
+ * and the data is written in IDAT chunks of INDEXED_PNG_CHUNK bytes, so only
+ * a row, a chunk and the deflate state are held in memory.
+ *
+ * @param[in] img The indexed image.
+ * @param[in] f   The file.
+ *
+ * @return 0 if everything goes right, SOM_NO_MEMORY if a memory allocation
+ *  (malloc) fail or -1 if the compression fail.
+ */
+static int png_write(const indexed *img, FILE *f){
+    static const unsigned char sig[8] = {137, 'P', 'N', 'G', '\r', '\n', 26,
+                                         '\n'};
+    unsigned char ihdr[13];
+    unsigned char plte[3 * INDEXED_MAX_COLORS];
+    unsigned char trns[INDEXED_MAX_COLORS];
+    int bits = indexed_bits(img->nbColors);
+    size_t rowBytes = ((size_t)img->width * bits + 7) / 8;
+    unsigned char *row, *z;
+    z_stream zs;
+    int nbTrns = 0;             // Number of tRNS entries
+    int flush;                  // Z_FINISH for the last row
+    int res;                    // zlib result
+    int y, c;
+
+    row = arena_alloc(img->mem, rowBytes + 1);
+    z = arena_alloc(img->mem, INDEXED_PNG_CHUNK);
+    memset(&zs, 0, sizeof(z_stream));
+    zs.zalloc = png_zalloc;
+    zs.zfree = png_zfree;
+    zs.opaque = img->mem;
+    if(row == NULL || z == NULL || 
+       deflateInit(&zs, INDEXED_PNG_LEVEL) != Z_OK){
+        arena_free(img->mem, row);
+        arena_free(img->mem, z);
+        return SOM_NO_MEMORY;
+    }
+
+    /* The palette: straight colors and their opacity if any is not opaque */
+    for(c = 0; c < img->nbColors; c++){
+        memcpy(&plte[c * 3], &img->colors[c * 4], 3);
+        trns[c] = img->colors[c * 4 + 3];
+        if(trns[c] != 255){
+            nbTrns = c + 1;
+        }
+    }
+
+    fwrite(sig, 1, 8, f);
+    put_be32(ihdr, img->width);
+    put_be32(&ihdr[4], img->height);
+    ihdr[8] = bits;
+    ihdr[9] = 3;                // Color type: palette
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    png_chunk(f, "IHDR", ihdr, 13);
+    png_chunk(f, "PLTE", plte, 3 * img->nbColors);
+    if(nbTrns > 0){
+        png_chunk(f, "tRNS", trns, nbTrns);
+    }
+
+    /* Compress the rows, writing a chunk each time the output is full */
+    zs.next_out = z;
+    zs.avail_out = INDEXED_PNG_CHUNK;
+    res = Z_OK;
+    for(y = 0; y < img->height && res == Z_OK; y++){
+        row[0] = 0;             // Filter type: none
+        png_pack(&row[1], &img->indices[(size_t)y * img->width], img->width,
+                 bits);
+        zs.next_in = row;
+        zs.avail_in = rowBytes + 1;
+        flush = y + 1 < img->height ? Z_NO_FLUSH : Z_FINISH;
+        do{
+            if(zs.avail_out == 0){
+                png_chunk(f, "IDAT", z, INDEXED_PNG_CHUNK);
+                zs.next_out = z;
+                zs.avail_out = INDEXED_PNG_CHUNK;
+            }
+            res = deflate(&zs, flush);
+        }while(res == Z_OK && (zs.avail_in > 0 || zs.avail_out == 0));
+        if(res == Z_BUF_ERROR){
+            res = Z_OK;         // No progress possible: the row is done
+        }
+    }
+    if(res == Z_STREAM_END){
+        png_chunk(f, "IDAT", z, INDEXED_PNG_CHUNK - zs.avail_out);
+        png_chunk(f, "IEND", NULL, 0);
+    }
+    deflateEnd(&zs);
+    arena_free(img->mem, row);
+    arena_free(img->mem, z);
+    return res == Z_STREAM_END ? 0 : -1;
+}
+
+/** Write a 16 bits little endian integer.
+ *
+ * @param[in] f The file.
+ * @param[in] v The integer.
+ */
+static void put_le16(FILE *f, int v){
+    fputc(v & 0xff, f);
+    fputc((v >> 8) & 0xff, f);
+}
+
+/** Write a code of the LZW data, by sub-blocks of up to 255 bytes.
+ *
+ * @param[in,out] s    The encoder.
+ * @param[in]     code The code.
+ * @param[in]     bits The size of the code.
+ */
+static void lzw_put(gif_lzw *s, int code, int bits){
+    s->acc |= (unsigned long)code << s->nbAcc;
+    s->nbAcc += bits;
+    while(s->nbAcc >= 8){
+        s->block[s->blockLen++] = s->acc & 0xff;
+        s->acc >>= 8;
+        s->nbAcc -= 8;
+        if(s->blockLen == 255){
+            fputc(255, s->f);
+            fwrite(s->block, 1, 255, s->f);
+            s->blockLen = 0;
+        }
+    }
+}
+
+/** Empty the dictionary of the LZW encoder.
+ *
+ * @param[in,out] s The encoder.
+ */
+static void lzw_reset(gif_lzw *s){
+    memset(s->keys, 0xff, sizeof(s->keys));
+}
+
+/** Compress the indices of a GIF image with the GIF variant of LZW.
+ *
+ * The strings of the dictionary are a known string (its code, the prefix)
+ * followed by an index (the suffix). They are kept in a hash table with
+ * linear probing. When the 4096 codes are used the dictionary is cleared.
+ *
+ * @param[in,out] s       The encoder.
+ * @param[in]     img     The indexed image.
+ * @param[in]     remap   The index written for each palette index.
+ * @param[in]     minBits The LZW minimum code size.
+ */
+static void lzw_encode(gif_lzw *s, const indexed *img,
+                       const unsigned char *remap, int minBits){
+    int clear = 1 << minBits;   // The clear code, followed by the end code
+    int next = clear + 2;       // Next code of the dictionary
+    int bits = minBits + 1;     // Current code size
+    int prefix, key;
+    unsigned int h;
+    size_t i, n = (size_t)img->width * img->height;
+
+    lzw_reset(s);
+    lzw_put(s, clear, bits);
+    prefix = remap[img->indices[0]];
+    for(i = 1; i < n; i++){
+        key = prefix << 8 | remap[img->indices[i]];
+        h = ((unsigned int)key * 2654435761u) >> 19 & (INDEXED_LZW_HASH - 1);
+        while(s->keys[h] != -1 && s->keys[h] != key){
+            h = (h + 1) & (INDEXED_LZW_HASH - 1);
+        }
+        if(s->keys[h] == key){
+            prefix = s->codes[h];
+            continue;
+        }
+
+        /* Unknown string: write the known one and add this one */
+        lzw_put(s, prefix, bits);
+        s->keys[h] = key;
+        s->codes[h] = next++;
+        if(next > 1 << bits){
+            bits++;
+        }
+        if(next == 1 << INDEXED_LZW_BITS){
+            lzw_put(s, clear, bits);
+            lzw_reset(s);
+            next = clear + 2;
+            bits = minBits + 1;
+        }
+        prefix = remap[img->indices[i]];
+    }
+    lzw_put(s, prefix, bits);
+
+    /* The decoder adds a code after the last one before reading the end */
+    if(next == 1 << bits && bits < INDEXED_LZW_BITS){
+        bits++;
+    }
+    lzw_put(s, clear + 1, bits);
+    if(s->nbAcc > 0){
+        lzw_put(s, 0, 8 - s->nbAcc);
+    }
+    if(s->blockLen > 0){
+        fputc(s->blockLen, s->f);
+        fwrite(s->block, 1, s->blockLen, s->f);
+    }
+    fputc(0, s->f);             // Block terminator
+}
+
+/** Write an indexed image as a GIF.
+ *
+ * @param[in] img The indexed image.
+ * @param[in] f   The file.
+ *
+ * @return 0 if everything goes right, SOM_NO_MEMORY if a memory allocation
+ *  (malloc) fail or -1 if the image is too big for a GIF.
+ */
+static int gif_write(const indexed *img, FILE *f){
+    unsigned char remap[INDEXED_MAX_COLORS];
+    int bits = indexed_bits(img->nbColors);
+    int trans = -1;             // The transparent index
+    gif_lzw *s;
+    int c;
+
+    if(img->width > 0xffff || img->height > 0xffff){
+        return -1;
+    }
+    s = arena_alloc(img->mem, sizeof(gif_lzw));
+    if(s == NULL){
+        return SOM_NO_MEMORY;
+    }
+    memset(s, 0, sizeof(gif_lzw));
+    s->f = f;
+    for(c = 0; c < img->nbColors; c++){
+        remap[c] = c;
+        if(img->colors[c * 4 + 3] < INDEXED_GIF_ALPHA){
+            trans = trans < 0 ? c : trans;
+            remap[c] = trans;
+        }
+    }
+
+    /* Header, screen descriptor and global color table */
+    fwrite("GIF89a", 1, 6, f);
+    put_le16(f, img->width);
+    put_le16(f, img->height);
+    fputc(0x80 | 7 << 4 | (bits - 1), f);
+    fputc(0, f);                // Background color
+    fputc(0, f);                // Pixel aspect ratio
+    for(c = 0; c < 1 << bits; c++){
+        if(c < img->nbColors){
+            fwrite(&img->colors[c * 4], 1, 3, f);
+        }
+        else{
+            fwrite("\0\0\0", 1, 3, f);
+        }
+    }
+
+    /* Graphic control extension (transparency) */
+    if(trans >= 0){
+        fwrite("\x21\xf9\x04\x01\0\0", 1, 6, f);
+        fputc(trans, f);
+        fputc(0, f);
+    }
+
+    /* Image descriptor and data */
+    fputc(0x2c, f);
+    put_le16(f, 0);
+    put_le16(f, 0);
+    put_le16(f, img->width);
+    put_le16(f, img->height);
+    fputc(0, f);
+    fputc(max(bits, 2), f);
+    lzw_encode(s, img, remap, max(bits, 2));
+    fputc(0x3b, f);             // Trailer
+
+    arena_free(img->mem, s);
+    return 0;
+}
+
+/** Write an indexed image, as a PNG or a GIF depending on the extension of
+ * the file (see indexed_format()).
+ *
+ * @param[in] img  The indexed image.
+ * @param[in] path The path of the file.
+ *
+ * The buffers of the encoder are taken from the arena of the image (see
+ * indexed_memory()).
+ *
+ * @return 0 if everything goes right, SOM_NO_MEMORY if a memory allocation
+ *  (malloc) fail, -1 otherwise (errno is set if the file can not be written).
+ */
+int indexed_write(const indexed *img, const char *path){
+    int format = indexed_format(path);
+    FILE *f;
+    int res;
+
+    if(format == INDEXED_NONE || img->width <= 0 || img->height <= 0){
+        return -1;
+    }
+    f = fopen(path, "wb");
+    if(f == NULL){
+        return -1;
+    }
+    if(format == INDEXED_PNG){
+        res = png_write(img, f);
+    }
+    else{
+        res = gif_write(img, f);
+    }
+    if(res == 0 && ferror(f)){
+        res = -1;
+    }
+    if(fclose(f) != 0 && res == 0){
+        res = -1;
+    }
+    return res;
+}
@@ -0,0 +1,42 @@
+#ifndef _INDEXED_H_
+#define _INDEXED_H_
+
+/*====| INCLUDES |============================================================*/
+#include <stdlib.h>
+#include "palette.h"
+
+/*====| DEFINES |=============================================================*/
+#define INDEXED_MAX_COLORS 256  // Colors an indexed image can have
+#define INDEXED_NONE 0          // indexed_format() results
+#define INDEXED_PNG 1
+#define INDEXED_GIF 2
+#define INDEXED_PNG_LEVEL 6     // zlib compression level of the PNG data
+#define INDEXED_PNG_CHUNK 65536 // Size of the PNG IDAT chunks
+#define INDEXED_ZLIB_MEMORY 278528  // zlib deflate state (see zconf.h)
+#define INDEXED_GIF_ALPHA 128   // Colors less opaque are GIF transparent
+#define INDEXED_LZW_BITS 12     // Maximal size of a GIF LZW code
+#define INDEXED_LZW_HASH 8192   // Size of the LZW dictionary hash table
+
+/*====| TYPES |===============================================================*/
+/** A posterized image kept as palette indices. */
+typedef struct{
+    int width;              // Width of the image
+    int height;             // Height of the image
+    int nbColors;           // Number of palette colors
+    unsigned char *colors;  // RGBA palette colors (8 bits, not premultiplied)
+    unsigned char *indices; // Palette index of each pixel, row by row
+    arena *mem;             // Where the buffers come from (NULL: the heap)
+} indexed;
+
+/*====| PROTOTYPES |==========================================================*/
+size_t indexed_memory(int width, int height);
+int indexed_init(indexed *img, const palette *pal, int width, int height, 
+                 arena *mem);
+void indexed_free(indexed *img);
+void indexed_set(indexed *img, size_t first, const unsigned int *indices,
+                 size_t nbIndices);
+int indexed_bits(int nbColors);
+int indexed_format(const char *path);
+int indexed_write(const indexed *img, const char *path);
+
+#endif
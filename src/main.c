@@ -11,41 +11,198 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <getopt.h>
+#include <unistd.h>
 #include "arr.h"
 #include "som.h"
+#include "palette.h"
+#include "serve.h"
+#include "shard.h"
+#include "indexed.h"
+#include "pnm.h"
 #include "util.h"
 
+/*=====| DEFINES |============================================================*/
+#define OPT_SERVE 256       // --serve (long option without short equivalent)
+#define OPT_WORKERS 257     // --workers
+#define OPT_PIPE 258        // --pipe
+#define OPT_WIDTH 259       // --width
+#define OPT_HEIGHT 260      // --height
+#define OPT_CHANNELS 261    // --channels
+#define OPT_MAX_MEMORY 262  // --max-memory
+#define OPT_TIME_BUDGET 263 // --time-budget
+#define OPT_INCREMENTAL 264 // --incremental
+#define OPT_WARM_EPOCHS 265 // --warm-epochs
+#define OPT_SHARD 266       // --shard
+#define OPT_MERGE 267       // --merge
+#define OPT_PALETTE 268     // --palette
+#define OPT_HOGWILD 269     // --hogwild
+#define OPT_NO_DISPLAY 270  // --no-display
+#define STREAM_BLOCK 32     // Size of the blocks compared between frames
+
+/*=====| TYPES |==============================================================*/
+/** The program variables set from the command line. */
+typedef struct{
+    palette_opts pal;           // How to compute the palette
+    char inFile[PATH_MAX];      // Path to the input image
+    char outFile[PATH_MAX];     // Path to the output image
+    char servePath[PATH_MAX];   // Path of the server socket
+    int workers;                // Number of server threads
+    int pipe;                   // Whether to posterize stdin to stdout
+    pnm_header raw;             // Frames description of a raw stream
+    size_t maxMemory;           // Memory limit of a job (0 for no limit)
+    int incremental;            // Whether to only update the changed parts
+    int warmEpochs;             // Fine tuning iterations of an update
+    int shard;                  // Index of the shard to train
+    int nbShards;               // Number of shards (0: no shard mode)
+    int merge;                  // Whether to merge shard files
+    char * const *inputs;       // The shard files to merge
+    int nbInputs;               // Number of shard files to merge
+    char paletteFile[PATH_MAX]; // Palette to use instead of training one
+    int noDisplay;              // Whether to only save the posterized image
+} args;
+
 /*=====| FUNCTIONS |==========================================================*/
 /** Print a usage message.
  */
 void usage(void){
     printf("USAGE: som -i input_file [-l posterization_level]\n"\
            "           [-e number8of8epochs] [-t treshold]\n"\
-           "           [-o output_file]\n\n"\
+           "           [-p patience] [-n number_of_trainings]\n"\
+           "           [-H] [--hogwild number_of_threads]\n"\
+           "           [--max-memory size] [--time-budget ms]\n"\
+           "           [--palette palette_file] [-o output_file]\n"\
+           "           [--no-display]\n"\
+           "       som --shard i/n -i input_file -o shard_file\n"\
+           "           [-l posterization_level] [-e number8of8epochs]\n"\
+           "           [-t treshold] [-p patience] [-n number_of_trainings]\n"\
+           "           [-H]\n"\
+           "       som --merge -o palette_file shard_file...\n"\
+           "           [-l posterization_level] [-e number8of8epochs]\n"\
+           "           [-n number_of_trainings]\n"\
+           "       som --serve socket_path [--workers number_of_threads]\n"\
+           "           [-l posterization_level] [-e number8of8epochs]\n"\
+           "           [-t treshold] [-p patience] [-n number_of_trainings]\n"\
+           "           [-H] [--time-budget ms]\n"\
+           "       som --pipe [--width w --height h [--channels c]]\n"\
+           "           [--incremental [--warm-epochs number8of8epochs]]\n"\
+           "           [-l posterization_level] [-e number8of8epochs]\n"\
+           "           [-t treshold] [-p patience] [-n number_of_trainings]\n"\
+           "           [-H] [--time-budget ms]\n\n"\
            "       options description:\n"\
            "           -i Specify the input image to posterize.\n"\
            "           -l Specify the posterization level.\n"\
            "              The higher the level, the more colors.\n"\
            "           -e Specify the number of iterations of the SOM.\n"\
            "           -t Specify the network threshold value.\n"\
-           "              If the network delta value ever fall under\n"\
-           "              this threshold, the training stop.\n"\
-           "           -o Specify the output posterized image path.\n");
+           "              If the averaged weight change of a neuron\n"\
+           "              ever fall under this threshold, the training\n"\
+           "              stop. Default is 0 (disabled).\n"\
+           "           -p Specify the number of quantization error checks\n"\
+           "              of a window. The training schedule is halved\n"\
+           "              when a window does not improve on the last one.\n"\
+           "              0 disables this stop condition.\n"\
+           "           -n Specify the number of SOM trained concurrently.\n"\
+           "              The one with the lowest error is kept.\n"\
+           "           -H Use a hierarchical SOM (faster for high\n"\
+           "              posterization levels, slightly less accurate).\n"\
+           "              A prime level gives more colors (e.g. 400\n"\
+           "              instead of 289 for 17).\n"\
+           "           --hogwild Specify the number of threads sharing\n"\
+           "              a single SOM training (lock-free updates).\n"\
+           "           -o Specify the output posterized image path.\n"\
+           "              A .png or .gif of 256 colors at most is\n"\
+           "              written as an indexed image.\n"\
+           "           --serve Run as a server listening on the given\n"\
+           "              Unix socket (see serve.c for the protocol).\n"\
+           "              The other options are the requests defaults.\n"\
+           "           --workers Specify the number of server threads\n"\
+           "              (or of posterization threads otherwise).\n"\
+           "              Default is the number of processors.\n"\
+           "           --pipe Posterize a stream of PGM, PPM or PAM frames\n"\
+           "              read on the standard input and write the\n"\
+           "              result on the standard output.\n"\
+           "           --width, --height Read raw interleaved pixels\n"\
+           "              frames of the given size instead of PNM.\n"\
+           "           --channels Specify the number of channels of the\n"\
+           "              raw frames (1, 3 or 4). Default is 3 (RGB).\n"\
+           "           --max-memory Specify the memory limit of the\n"\
+           "              posterization (e.g. 64M). Big images are then\n"\
+           "              trained on a subsample and posterized by tiles.\n"\
+           "              Not for --serve, --pipe, --shard or --merge.\n"\
+           "           --time-budget Specify the time limit (in ms) of\n"\
+           "              the training and posterization of an image.\n"\
+           "              Big images may then give a blocky preview.\n"\
+           "           --incremental Only posterize again the parts of a\n"\
+           "              frame which changed since the previous one,\n"\
+           "              with the same palette while it remains valid.\n"\
+           "           --warm-epochs Specify the number of iterations\n"\
+           "              to fine tune the palette when it no longer\n"\
+           "              fits the changed parts. 0 retrains it from\n"\
+           "              scratch instead. Default is 200.\n"\
+           "           --shard Train on the i-th of n bands of rows of\n"\
+           "              the image and write its weighted colors.\n"\
+           "           --merge Merge shard files into a palette file.\n"\
+           "           --palette Posterize with a palette file (made\n"\
+           "              by --merge) instead of training one.\n"\
+           "           --no-display Save the posterized image without\n"\
+           "              displaying it first.\n");
 }
 
 /** Parse the options from the command line.
  *
- * @param[in]  argc       Number of arguments on the command line.
- * @param[in]  argv       The arguments of the command line.
- * @param[out] postLevel  Posterization level (set by -l / default: 2).
- * @param[out] epochs     Number of training stage (set by -e / default: 3000).
- * @param[out] thresh     Network threshold value (set by -t / default: 0.001).
- * @param[out] inFile     Path to the input image (must be set with -i).
- * @param[out] outFile    Path to the output image (set by -o).
+ * The program variables are:
+ *  - the posterization level (set by -l / default: 2);
+ *  - the number of training stages (set by -e / default: 3000);
+ *  - the network threshold value (set by -t / default: 0, disabled);
+ *  - the patience (set by -p / default: 5);
+ *  - the number of concurrent trainings (set by -n / default: 1);
+ *  - whether to use a hierarchical SOM (set by -H);
+ *  - the number of threads of a shared training (set by --hogwild / 
+ *    default: 0, serial training);
+ *  - the path to the input image (must be set with -i unless --serve is);
+ *  - the path to the output image (set by -o);
+ *  - the path of the server socket (set by --serve);
+ *  - the number of server or posterization threads (set by --workers / 
+ *    default: number of processors);
+ *  - whether to posterize a stream of frames (set by --pipe);
+ *  - the raw frames dimensions (set by --width, --height and --channels /
+ *    default: 3 channels);
+ *  - the memory limit (set by --max-memory / default: none);
+ *  - the time budget (set by --time-budget / default: none);
+ *  - whether to update the frames incrementally (set by --incremental) and
+ *    the fine tuning iterations (set by --warm-epochs / default: 200);
+ *  - the shard to train (set by --shard);
+ *  - whether to merge shard files (set by --merge), the files being the
+ *    non-option arguments;
+ *  - the palette file to use (set by --palette);
+ *  - whether to skip the display of the result (set by --no-display).
+ *
+ * @param[in]  argc Number of arguments on the command line.
+ * @param[in]  argv The arguments of the command line.
+ * @param[out] a    The program variables. They must be set to their default 
+ *  values beforehand.
  */
-int set_vars_from_args(int argc, char * const argv[], int *postLevel,
-                       int *epochs, float *thresh, char *inFile, char *outFile){
+int set_vars_from_args(int argc, char * const argv[], args *a){
     extern char *optarg;
+    static const struct option longOpts[] = {
+        {"serve", required_argument, NULL, OPT_SERVE},
+        {"workers", required_argument, NULL, OPT_WORKERS},
+        {"pipe", no_argument, NULL, OPT_PIPE},
+        {"width", required_argument, NULL, OPT_WIDTH},
+        {"height", required_argument, NULL, OPT_HEIGHT},
+        {"channels", required_argument, NULL, OPT_CHANNELS},
+        {"max-memory", required_argument, NULL, OPT_MAX_MEMORY},
+        {"time-budget", required_argument, NULL, OPT_TIME_BUDGET},
+        {"incremental", no_argument, NULL, OPT_INCREMENTAL},
+        {"warm-epochs", required_argument, NULL, OPT_WARM_EPOCHS},
+        {"shard", required_argument, NULL, OPT_SHARD},
+        {"merge", no_argument, NULL, OPT_MERGE},
+        {"palette", required_argument, NULL, OPT_PALETTE},
+        {"hogwild", required_argument, NULL, OPT_HOGWILD},
+        {"no-display", no_argument, NULL, OPT_NO_DISPLAY},
+        {NULL, 0, NULL, 0}
+    };
+    som_opts *opts = &a->pal.som;
     int index;
     int tmp;
     float ftmp;
@@ -53,7 +210,8 @@ int set_vars_from_args(int argc, char * const argv[], int *postLevel,
     int res = 0;
 
     opterr = 0;
-    while((c = getopt(argc, argv, "hi:l:e:t:o:")) != -1){
+    while((c = getopt_long(argc, argv, "hi:l:e:t:p:n:Ho:", longOpts, 
+                           NULL)) != -1){
         switch(c){
             case 'h':
                 printf(
@@ -74,17 +232,17 @@ int set_vars_from_args(int argc, char * const argv[], int *postLevel,
                 printf("You can specify a custom output file name with -o.\n");
                 printf("Supported formats are: jpeg, jpg, jpe, jp2, tiff,\n");
                 printf("tif and png.\n");
-                printf("But transparency is not correctly handle by default\n");
-                printf("in OpenCV.\n\n");
+                printf("The transparency of the image (if any) is kept and\n");
+                printf("posterized with the colors.\n\n");
                 usage();
                 exit(0);
             case 'i':
-                strcpy(inFile, optarg);
+                strcpy(a->inFile, optarg);
                 break;
             case 'l':
                 tmp = (int)strtol(optarg, NULL, 10);
                 if(tmp > 0){
-                    *postLevel = tmp;
+                    a->pal.postLevel = tmp;
                 }
                 else{
                     fprintf(stderr, "WARNING: Invalid argument for option -l. "\
@@ -94,7 +252,7 @@ int set_vars_from_args(int argc, char * const argv[], int *postLevel,
             case 'e':
                 tmp = (int)strtol(optarg, NULL, 10);
                 if(tmp > 0){
-                    *epochs = tmp;
+                    opts->noEpoch = tmp;
                 }
                 else{
                     fprintf(stderr, "WARNING: Invalid argument for option -e. "\
@@ -103,15 +261,134 @@ int set_vars_from_args(int argc, char * const argv[], int *postLevel,
                 break;
             case 't':
                 if(sscanf(optarg, "%f", &ftmp) != 0){
-                    *thresh = ftmp;
+                    opts->thresh = ftmp;
                 }
                 else{
                     fprintf(stderr, "WARNING: Invalid argument for option -t. "\
                             "Expecting float. Using default value.\n");
                 }
                 break;
+            case 'p':
+                tmp = (int)strtol(optarg, NULL, 10);
+                if(tmp >= 0){
+                    opts->patience = tmp;
+                }
+                else{
+                    fprintf(stderr, "WARNING: Invalid argument for option -p. "\
+                            "Expecting integer. Using default value.\n");
+                }
+                break;
+            case 'n':
+                tmp = (int)strtol(optarg, NULL, 10);
+                if(tmp > 0){
+                    a->pal.nbRuns = tmp;
+                }
+                else{
+                    fprintf(stderr, "WARNING: Invalid argument for option -n. "\
+                            "Expecting integer. Using default value.\n");
+                }
+                break;
+            case 'H':
+                a->pal.tree = 1;
+                break;
             case 'o':
-                strcpy(outFile, optarg);
+                strcpy(a->outFile, optarg);
+                break;
+            case OPT_SERVE:
+                strcpy(a->servePath, optarg);
+                break;
+            case OPT_WORKERS:
+                tmp = (int)strtol(optarg, NULL, 10);
+                if(tmp > 0){
+                    a->workers = tmp;
+                }
+                else{
+                    fprintf(stderr, "WARNING: Invalid argument for option "\
+                            "--workers. Expecting integer. Using default "\
+                            "value.\n");
+                }
+                break;
+            case OPT_PIPE:
+                a->pipe = 1;
+                break;
+            case OPT_WIDTH:
+                a->raw.format = PNM_RAW;
+                a->raw.width = (int)strtol(optarg, NULL, 10);
+                break;
+            case OPT_HEIGHT:
+                a->raw.format = PNM_RAW;
+                a->raw.height = (int)strtol(optarg, NULL, 10);
+                break;
+            case OPT_CHANNELS:
+                tmp = (int)strtol(optarg, NULL, 10);
+                if(tmp == 1 || tmp == 3 || tmp == 4){
+                    a->raw.channels = tmp;
+                }
+                else{
+                    fprintf(stderr, "WARNING: Invalid argument for option "\
+                            "--channels. Expecting 1, 3 or 4. Using default "\
+                            "value.\n");
+                }
+                break;
+            case OPT_MAX_MEMORY:
+                a->maxMemory = parse_size(optarg);
+                if(a->maxMemory == 0){
+                    fprintf(stderr, "WARNING: Invalid argument for option "\
+                            "--max-memory. Expecting size (e.g. 64M). No "\
+                            "limit is used.\n");
+                }
+                break;
+            case OPT_TIME_BUDGET:
+                if(sscanf(optarg, "%f", &ftmp) == 1 && ftmp > 0){
+                    a->pal.timeBudget = ftmp;
+                }
+                else{
+                    fprintf(stderr, "WARNING: Invalid argument for option "\
+                            "--time-budget. Expecting milliseconds. No "\
+                            "limit is used.\n");
+                }
+                break;
+            case OPT_INCREMENTAL:
+                a->incremental = 1;
+                break;
+            case OPT_WARM_EPOCHS:
+                tmp = (int)strtol(optarg, NULL, 10);
+                if(tmp >= 0){
+                    a->warmEpochs = tmp;
+                }
+                else{
+                    fprintf(stderr, "WARNING: Invalid argument for option "\
+                            "--warm-epochs. Expecting integer. Using default "\
+                            "value.\n");
+                }
+                break;
+            case OPT_SHARD:
+                if(sscanf(optarg, "%d/%d", &a->shard, &a->nbShards) != 2 ||
+                   a->shard < 0 || a->shard >= a->nbShards){
+                    fprintf(stderr, "ERROR: Invalid argument for option "\
+                            "--shard. Expecting i/n with 0 <= i < n.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_MERGE:
+                a->merge = 1;
+                break;
+            case OPT_PALETTE:
+                strcpy(a->paletteFile, optarg);
+                break;
+            case OPT_HOGWILD:
+                tmp = (int)strtol(optarg, NULL, 10);
+                if(tmp > 0){
+                    a->pal.hogwild = tmp;
+                }
+                else{
+                    fprintf(stderr, "WARNING: Invalid argument for option "\
+                            "--hogwild. Expecting integer. Using default "\
+                            "value.\n");
+                }
+                break;
+            case OPT_NO_DISPLAY:
+                a->noDisplay = 1;
                 break;
             case '?':
                 if(optopt == 'c'){
@@ -130,9 +407,39 @@ int set_vars_from_args(int argc, char * const argv[], int *postLevel,
                 abort();
         }
     }
-    for(index = optind; index < argc; index++)
-        printf("Non-option argument: %s\n", argv[index]);
-    if(strcmp(inFile, "") == 0){
+    if(a->merge){
+        a->inputs = &argv[optind];
+        a->nbInputs = argc - optind;
+    }
+    else{
+        for(index = optind; index < argc; index++)
+            printf("Non-option argument: %s\n", argv[index]);
+    }
+    if((a->merge || a->nbShards > 0) && strcmp(a->outFile, "") == 0){
+        fprintf(stderr, "ERROR: --shard and --merge need an output file\n");
+        usage();
+        res = 1;
+    }
+    else if(a->merge && a->nbInputs == 0){
+        fprintf(stderr, "ERROR: no shard file to merge\n");
+        usage();
+        res = 1;
+    }
+    else if(a->pipe && a->raw.format == PNM_RAW && 
+            (a->raw.width <= 0 || a->raw.height <= 0)){
+        fprintf(stderr, "ERROR: raw frames need both --width and --height\n");
+        usage();
+        res = 1;
+    }
+    else if(a->maxMemory > 0 && (strcmp(a->servePath, "") != 0 || a->pipe ||
+                                 a->merge || a->nbShards > 0)){
+        fprintf(stderr, "ERROR: --max-memory can not be used with --serve, "\
+                "--pipe, --shard or --merge\n");
+        usage();
+        res = 1;
+    }
+    else if(strcmp(a->inFile, "") == 0 && strcmp(a->servePath, "") == 0 &&
+            !a->pipe && !a->merge){
         fprintf(stderr, "ERROR: input file is missing\n");
         usage();
         res = 1;
@@ -140,6 +447,480 @@ int set_vars_from_args(int argc, char * const argv[], int *postLevel,
     return res;
 }
 
+/** Find the parts of a frame which changed since the previous one.
+ *
+ * The frames are compared by blocks of STREAM_BLOCK x STREAM_BLOCK pixels. 
+ * The changed blocks next to each other on a row of blocks are merged into a
+ * single rectangle.
+ *
+ * @param[out] rects The changed rectangles. There can be up to one for every
+ *  block.
+ * @param[in]  cur   The pixels of the frame.
+ * @param[in]  prev  The pixels of the previous frame.
+ * @param[in]  h     The frames description.
+ *
+ * @return The number of changed rectangles.
+ */
+int find_dirty_rects(palette_rect *rects, const unsigned char *cur, 
+                     const unsigned char *prev, const pnm_header *h){
+    size_t rowSize = (size_t)h->width * h->channels;
+    size_t offset;
+    int nbRects = 0;
+    int bx, by, y, dirty;
+    int bw, bh;
+
+    for(by = 0; by < h->height; by += STREAM_BLOCK){
+        bh = min(STREAM_BLOCK, h->height - by);
+        for(bx = 0; bx < h->width; bx += STREAM_BLOCK){
+            bw = min(STREAM_BLOCK, h->width - bx);
+            dirty = 0;
+            for(y = by; y < by + bh && !dirty; y++){
+                offset = y * rowSize + (size_t)bx * h->channels;
+                dirty = memcmp(&cur[offset], &prev[offset], 
+                               (size_t)bw * h->channels) != 0;
+            }
+            if(!dirty){
+                continue;
+            }
+            if(nbRects > 0 && rects[nbRects - 1].y == by && 
+               rects[nbRects - 1].x + rects[nbRects - 1].width == bx){
+                rects[nbRects - 1].width += bw;
+            }
+            else{
+                rects[nbRects].x = bx;
+                rects[nbRects].y = by;
+                rects[nbRects].width = bw;
+                rects[nbRects].height = bh;
+                nbRects++;
+            }
+        }
+    }
+    return nbRects;
+}
+
+/** Posterize a stream of frames.
+ *
+ * The frames are read one after the other until the end of the input stream.
+ * Each one is posterized with its own palette and written to the output
+ * stream in the format it was read. No image codec is involved: the frames
+ * are binary PGM, PPM or PAM images, or raw interleaved pixels of a fixed
+ * size. The buffers are reused from one frame to the next.
+ *
+ * In incremental mode, a frame of the same size as the previous one is 
+ * compared to it and only its changed blocks are posterized again, with the
+ * previous palette (see palette_update()). The palette is trained from 
+ * scratch only when it is no longer valid for the changed pixels.
+ *
+ * @param[in] in  The input stream.
+ * @param[in] out The output stream.
+ * @param[in] a   The program variables.
+ *
+ * @return 0 if every frame was posterized or 1 on an error.
+ */
+int posterize_stream(FILE *in, FILE *out, const args *a){
+    pnm_header h = a->raw;      // The current frame description
+    pnm_header prevH;           // The previous frame description
+    unsigned char *bytes = NULL;// The frame pixels
+    unsigned char *prev = NULL; // The previous frame pixels (incremental)
+    unsigned char *postBytes = NULL; // The posterized pixels (incremental)
+    unsigned char *outBytes;    // The posterized frame pixels
+    unsigned char *swap;
+    float *pixels = NULL;       // The frame RGBA pixels
+    float *post = NULL;         // The posterized RGBA pixels (incremental)
+    unsigned int *indices = NULL; // Palette color of each pixel (incremental)
+    palette_rect *rects = NULL; // Changed parts of the frame (incremental)
+    size_t nbBlocks;            // Number of blocks of the frame
+    size_t rectsCapacity = 0;   // Number of rectangles 'rects' can hold
+    int nbRects;                // Number of changed parts
+    size_t nbDirty;             // Number of pixels of the changed parts
+    size_t capacity = 0;        // Number of pixels the buffers can hold
+    size_t nbPixels;            // Number of pixels of the frame
+    som_workspace ws = {0};     // Training buffers
+    som_stats stats;            // Training statistics
+    palette pal;                // The frame palette
+    int hasPal = 0;             // Whether 'pal' holds the previous palette
+    int update;                 // palette_update() result
+    int frame = 0;              // Frame number
+    int nbNeurons = a->pal.postLevel * a->pal.postLevel;
+    int res = 0;
+    int r, i, y;
+    int k;                      // Size of the preview blocks
+    double start;
+
+    memset(&prevH, 0, sizeof(pnm_header));
+    if(som_workspace_init(&ws, nbNeurons, NULL) != SOM_OK){
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    while((r = pnm_read_header(in, &h)) > 0){
+        start = now_ms();
+        nbPixels = (size_t)h.width * h.height;
+        if(nbPixels > capacity){
+            free(bytes);
+            free(pixels);
+            bytes = malloc(nbPixels * 4);
+            pixels = arr_alloc_vec4(NULL, nbPixels);
+            capacity = nbPixels;
+            if(a->incremental){
+                free(prev);
+                free(postBytes);
+                free(post);
+                free(indices);
+                prev = malloc(nbPixels * 4);
+                postBytes = malloc(nbPixels * 4);
+                post = arr_alloc_vec4(NULL, nbPixels);
+                indices = malloc(sizeof(unsigned int) * nbPixels);
+                prevH.width = 0;    // The previous frame is lost
+            }
+            if(bytes == NULL || pixels == NULL || (a->incremental && 
+               (prev == NULL || postBytes == NULL || post == NULL || 
+                indices == NULL))){
+                fprintf(stderr, "out of memory\n");
+                res = 1;
+                break;
+            }
+        }
+        if(fread(bytes, h.channels, nbPixels, in) != nbPixels){
+            fprintf(stderr, "ERROR: frame %d is truncated\n", frame);
+            res = 1;
+            break;
+        }
+
+        /* Only update the changed parts of the previous frame if possible */
+        update = PALETTE_STALE;
+        nbDirty = nbPixels;
+        if(a->incremental && hasPal && h.width == prevH.width && 
+           h.height == prevH.height && h.channels == prevH.channels){
+            nbBlocks = (size_t)((h.width + STREAM_BLOCK - 1) / STREAM_BLOCK) *
+                       ((h.height + STREAM_BLOCK - 1) / STREAM_BLOCK);
+            if(nbBlocks > rectsCapacity){
+                free(rects);
+                rects = malloc(sizeof(palette_rect) * nbBlocks);
+                rectsCapacity = rects != NULL ? nbBlocks : 0;
+                if(rects == NULL){
+                    fprintf(stderr, "out of memory\n");
+                    res = 1;
+                    break;
+                }
+            }
+            nbRects = find_dirty_rects(rects, bytes, prev, &h);
+            nbDirty = 0;
+            for(i = 0; i < nbRects; i++){
+                for(y = rects[i].y; y < rects[i].y + rects[i].height; y++){
+                    arr_from_bytes(
+                        &pixels[((size_t)y * h.width + rects[i].x) * 
+                                PIX_CHANNELS],
+                        &bytes[((size_t)y * h.width + rects[i].x) * 
+                               h.channels],
+                        rects[i].width, h.channels);
+                }
+                nbDirty += (size_t)rects[i].width * rects[i].height;
+            }
+            update = palette_update(&pal, post, indices, pixels, h.width, 
+                                    h.height, rects, nbRects, a->warmEpochs,
+                                    &a->pal.som);
+            if(update == SOM_NO_MEMORY){
+                fprintf(stderr, "out of memory\n");
+                res = 1;
+                break;
+            }
+            stats.epochs = update == PALETTE_TUNED ? a->warmEpochs : 0;
+            stats.qerror = pal.qerror;
+        }
+
+        /* Otherwise posterize the whole frame */
+        k = 1;
+        if(update == PALETTE_STALE){
+            arr_from_bytes(pixels, bytes, nbPixels, h.channels);
+            if(hasPal){
+                palette_free(&pal);
+                hasPal = 0;
+            }
+            if(palette_train(&pal, pixels, nbPixels, &a->pal, &ws, 
+                             &stats) != SOM_OK){
+                fprintf(stderr, "out of memory\n");
+                res = 1;
+                break;
+            }
+            hasPal = 1;
+            if(a->incremental){
+                palette_index(&pal, indices, pixels, nbPixels);
+                palette_render(&pal, post, indices, nbPixels);
+            }
+            else{
+                k = palette_posterize_until(&pal, pixels, h.width, h.height,
+                                            a->pal.timeBudget > 0 ? 
+                                            start + a->pal.timeBudget : 0,
+                                            a->workers);
+            }
+        }
+
+        /* Write the posterized frame */
+        if(a->incremental){
+            outBytes = postBytes;
+            if(update == PALETTE_KEPT){
+                for(i = 0; i < nbRects; i++){
+                    for(y = rects[i].y; y < rects[i].y + rects[i].height; 
+                        y++){
+                        arr_to_bytes(
+                            &outBytes[((size_t)y * h.width + rects[i].x) * 
+                                      h.channels],
+                            &post[((size_t)y * h.width + rects[i].x) * 
+                                  PIX_CHANNELS],
+                            rects[i].width, h.channels);
+                    }
+                }
+            }
+            else{
+                arr_to_bytes(outBytes, post, nbPixels, h.channels);
+            }
+        }
+        else{
+            outBytes = bytes;
+            arr_to_bytes(outBytes, pixels, nbPixels, h.channels);
+        }
+        if(pnm_write_header(out, &h) != 0 || 
+           fwrite(outBytes, h.channels, nbPixels, out) != nbPixels ||
+           fflush(out) != 0){
+            perror("write");
+            res = 1;
+            break;
+        }
+        if(a->incremental){
+            /* The input frame is compared to the next one */
+            swap = prev;
+            prev = bytes;
+            bytes = swap;
+            prevH = h;
+        }
+        else{
+            palette_free(&pal);
+            hasPal = 0;
+        }
+        fprintf(stderr, "Frame %d: %dx%d, %d iterations (quantization "\
+                "error: %f), %.3f ms%s", frame, h.width, h.height, 
+                stats.epochs, stats.qerror, now_ms() - start,
+                k > 1 ? " (preview)" : "");
+        if(update != PALETTE_STALE){
+            fprintf(stderr, " (palette %s, %zu changed pixels)", 
+                    update == PALETTE_KEPT ? "kept" : "fine tuned", nbDirty);
+        }
+        fprintf(stderr, "\n");
+        frame++;
+    }
+    if(r < 0){
+        fprintf(stderr, "ERROR: invalid header for frame %d\n", frame);
+        res = 1;
+    }
+
+    if(hasPal){
+        palette_free(&pal);
+    }
+    free(bytes);
+    free(prev);
+    free(postBytes);
+    free(pixels);
+    free(post);
+    free(indices);
+    free(rects);
+    som_workspace_free(&ws);
+    return res;
+}
+
+/** Train a shard of an image and write its weighted colors.
+ *
+ * The shard is the a->shard-th of a->nbShards bands of rows of the input
+ * image. Its palette is SHARD_LEVEL_FACTOR times finer than the final one so
+ * that the merge has more colors to choose from.
+ *
+ * @param[in] a The program variables.
+ *
+ * @return 0 if the shard file was written or 1 on an error.
+ */
+int train_shard(const args *a){
+    palette_opts opts = a->pal;
+    unsigned int nbPixels;
+    int firstRow, nbRows;
+    som_stats stats;
+    float *pixels;
+    IplImage *img;
+    palette pal;
+    shard s;
+    int res = 0;
+
+    img = arr_IplImage_8U(cvLoadImage(a->inFile, CV_LOAD_IMAGE_UNCHANGED));
+    if(!img){
+        fprintf(stderr, "ERROR: %s can not be loaded\n", a->inFile);
+        return 1;
+    }
+    firstRow = (int)((long)img->height * a->shard / a->nbShards);
+    nbRows = (int)((long)img->height * (a->shard + 1) / a->nbShards) - 
+             firstRow;
+    nbPixels = nbRows * img->width;
+    pixels = arr_alloc_vec4(NULL, nbPixels);
+    if(nbPixels == 0 || pixels == NULL){
+        fprintf(stderr, "ERROR: shard %d/%d is empty or too big\n", 
+                a->shard, a->nbShards);
+        free(pixels);
+        cvReleaseImage(&img);
+        return 1;
+    }
+    arr_from_IplImage(pixels, img, firstRow, nbRows);
+    cvReleaseImage(&img);
+
+    opts.postLevel *= SHARD_LEVEL_FACTOR;
+    opts.som.mem = NULL;
+    if(palette_train(&pal, pixels, nbPixels, &opts, NULL, &stats) != SOM_OK){
+        fprintf(stderr, "out of memory\n");
+        free(pixels);
+        return 1;
+    }
+    if(shard_from_palette(&s, &pal, pixels, nbPixels) != SOM_OK){
+        fprintf(stderr, "out of memory\n");
+        palette_free(&pal);
+        free(pixels);
+        return 1;
+    }
+    fprintf(stderr, "Shard %d/%d: rows %d to %d, %d iterations (%d colors, "\
+            "quantization error: %f)\n", a->shard, a->nbShards, firstRow, 
+            firstRow + nbRows - 1, stats.epochs, pal.nbColors, stats.qerror);
+    if(shard_write(&s, a->outFile) != 0){
+        perror(a->outFile);
+        res = 1;
+    }
+
+    shard_free(&s);
+    palette_free(&pal);
+    free(pixels);
+    return res;
+}
+
+/** Merge shard files into a palette file.
+ *
+ * @param[in] a The program variables.
+ *
+ * @return 0 if the palette file was written or 1 on an error.
+ */
+int merge_shards(const args *a){
+    shard *shards;
+    shard merged;
+    double weight = 0.;
+    int i, r;
+    int res = 0;
+
+    shards = calloc(a->nbInputs, sizeof(shard));
+    if(shards == NULL){
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for(i = 0; i < a->nbInputs && res == 0; i++){
+        if(shard_read(&shards[i], a->inputs[i]) != 0){
+            fprintf(stderr, "ERROR: %s is not a valid shard file\n", 
+                    a->inputs[i]);
+            res = 1;
+        }
+    }
+    if(res == 0){
+        r = shard_merge(&merged, shards, a->nbInputs, &a->pal);
+        if(r != SOM_OK){
+            fprintf(stderr, r == SOM_NO_MEMORY ? "out of memory\n" : 
+                    "ERROR: the shards are empty\n");
+            res = 1;
+        }
+        else{
+            for(i = 0; i < merged.nbColors; i++){
+                weight += merged.weights[i];
+            }
+            fprintf(stderr, "Merged %d shards: %d colors for %.0f pixels\n",
+                    a->nbInputs, merged.nbColors, weight);
+            if(shard_write(&merged, a->outFile) != 0){
+                perror(a->outFile);
+                res = 1;
+            }
+            shard_free(&merged);
+        }
+    }
+
+    for(i = 0; i < a->nbInputs; i++){
+        shard_free(&shards[i]);
+    }
+    free(shards);
+    return res;
+}
+
+/** Read a palette file.
+ *
+ * @param[out] pal  The palette. It must be released with palette_free().
+ * @param[in]  path The path of the palette file (see shard_write()).
+ *
+ * @return 0 if the palette was read or -1 on an error.
+ */
+int read_palette(palette *pal, const char *path){
+    shard s;
+    int res;
+
+    if(shard_read(&s, path) != 0){
+        return -1;
+    }
+    res = shard_to_palette(pal, &s) == SOM_OK ? 0 : -1;
+    shard_free(&s);
+    return res;
+}
+
+/** Compute the memory a posterization job takes.
+ *
+ * @param[in] opts      The palette options.
+ * @param[in] nbPixels  The number of pixels held in memory at once.
+ * @param[in] outMemory The memory of the output (see indexed_memory()). If 
+ *  it is an indexed image, the palette indices of the pixels held in memory
+ *  are counted as well.
+ *
+ * @return The size (in bytes) of the job arena.
+ */
+size_t job_memory(const palette_opts *opts, size_t nbPixels, 
+                  size_t outMemory){
+    size_t indices = outMemory > 0 ? 
+                     sizeof(unsigned int) * nbPixels + ARENA_ALIGN : 0;
+
+    return sizeof(float) * PIX_CHANNELS * nbPixels + ARENA_ALIGN +
+           palette_memory(opts, nbPixels) + outMemory + indices;
+}
+
+/** Compute how many pixels a job can hold in memory at once.
+ *
+ * @param[in] opts      The palette options.
+ * @param[in] nbPixels  The number of pixels of the image.
+ * @param[in] minPixels The minimum number of pixels (one row of the image).
+ * @param[in] outMemory The memory of the output (see indexed_memory()).
+ * @param[in] maxMemory The memory limit (0 for no limit).
+ *
+ * @return The highest number of pixels (at most nbPixels) whose job fits in 
+ *  'maxMemory', or 0 if not even 'minPixels' pixels fit.
+ */
+size_t job_pixels(const palette_opts *opts, size_t nbPixels, 
+                  size_t minPixels, size_t outMemory, size_t maxMemory){
+    size_t lo = minPixels;
+    size_t hi = nbPixels;
+    size_t mid;
+
+    if(maxMemory == 0 || job_memory(opts, nbPixels, outMemory) <= maxMemory){
+        return nbPixels;
+    }
+    if(job_memory(opts, minPixels, outMemory) > maxMemory){
+        return 0;
+    }
+    while(lo < hi){
+        mid = lo + (hi - lo + 1) / 2;
+        if(job_memory(opts, mid, outMemory) <= maxMemory){
+            lo = mid;
+        }
+        else{
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
 /** The main function
  *
  * The main function scan the command line and set the program variables using
@@ -158,154 +939,265 @@ int set_vars_from_args(int argc, char * const argv[], int *postLevel,
  *  rows * columns = rows^2 = columns^2 = posterization level^2 = number of 
  *  neurons.
  *
- * @warning The transparency in file formats which support it is not correctly
- *  handled.
+ * @note The pixels are handled as RGBA vectors whatever the number of channels
+ *  of the image. The colors are premultiplied by the alpha channel so the
+ *  transparency of the image is posterized along with its colors.
  *
- * @todo 0.0.2
- *  Handle transparency with opencv and the SOM algorithm. The program 
- * currently use the number of channels of the image but it is always 3 (RGB) 
- * for now.
+ * @note All the memory of the job comes from a single arena sized beforehand.
+ *  If it would exceed the --max-memory limit, the SOM is trained on a 
+ *  regular subsample of the pixels and the image is posterized a band of rows
+ *  at a time, both in the same buffer. The decoded image itself is not 
+ *  counted in the limit.
+ *
+ * @note A PNG or GIF output of at most 256 colors is written from the palette
+ *  indices found by the colors lookup (see indexed.c) instead of being saved
+ *  by OpenCV as a truecolor image. The indices and the encoder buffers are
+ *  taken from the arena of the job, so they count in the limit. A palette of
+ *  more colors is saved as truecolor, without this memory.
  */
 int main(int argc, char * const argv[]){
     const char *ext;            // The file extension (image format)
     char saveName[PATH_MAX];    // Path to the saved posterized image
     unsigned int nbPixels;      // Number of pixels of the image
-	float **origPixels;         // Pixels of the original, untouched image
-    float **postPixels;         // Pixels of the posterized image
-    float **trainRes;           // Output of the SOM (its map)
-    int height;                 // Image height (in pixels)
-    int width;                  // image width (in pixels)
-    int channels;               // Number of channels of the image
-    int i;                      // Iterator indice
-    int j;                      // Iterator indice
-    int nbNeurons;              // Number of neurons of the SOM
-    int postLevel = 2;
-    int epochs = 3000;
-    float thresh = 0.001;
-    char inFile[PATH_MAX] = {'\0'};
-    char outFile[PATH_MAX] = {'\0'};
+    size_t nbLoaded;            // Number of pixels held in memory at once
+    size_t outMemory = 0;       // Memory of an indexed output
+    int nbColors;               // Number of colors of the palette
+    int nbRows;                 // Number of rows of a tile
+    int row;                    // First row of the current tile
+    int k = 1;                  // Size of the preview blocks
+    int res = 0;                // Exit status
+    double deadline = 0;        // When the posterization must be done by
+    double start;               // When the training started
+    float *pixels;              // Pixels of the image (or of a part of it)
+    unsigned int *indices = NULL; // Palette indices of the 'pixels'
+    arena mem;                  // Memory of the job
+    palette pal;                // Output of the SOM (its map)
+    indexed out;                // Palette indices of the posterized image
+    som_stats stats;            // Training statistics
+    args a;                     // The program variables
     IplImage *img;
 
     /* Set the program variables using the cmdl arguments */
-    if(set_vars_from_args(argc, argv, &postLevel, &epochs, &thresh, inFile, 
-                          outFile) > 0){
+    memset(&a, 0, sizeof(args));
+    palette_opts_init(&a.pal);
+    a.workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    a.raw.format = -1;
+    a.raw.channels = 3;
+    a.warmEpochs = 200;
+    if(set_vars_from_args(argc, argv, &a) > 0){
         return EXIT_FAILURE;
     }
-    ext = get_filename_ext(inFile);
-    nbNeurons = (int)pow(postLevel, 2);
+    if(strcmp(a.servePath, "") != 0){
+        return serve(a.servePath, a.workers, &a.pal) == 0 ? 0 : EXIT_FAILURE;
+    }
+    if(a.pipe){
+        return posterize_stream(stdin, stdout, &a) == 0 ? 0 : EXIT_FAILURE;
+    }
+    if(a.merge){
+        return merge_shards(&a) == 0 ? 0 : EXIT_FAILURE;
+    }
+    if(a.nbShards > 0){
+        return train_shard(&a) == 0 ? 0 : EXIT_FAILURE;
+    }
+    ext = get_filename_ext(a.inFile);
 
-    /* Load the image */
-    img = cvLoadImage(inFile, CV_LOAD_IMAGE_COLOR);
+    /* Load the image (keeping its alpha channel if any, at 8 bits) */
+    img = arr_IplImage_8U(cvLoadImage(a.inFile, CV_LOAD_IMAGE_UNCHANGED));
     if(!img){
         printf("Image can not be loaded!\n");
         return 1;
     }
+    nbPixels = img->height * img->width;
 
-    /* Get the image data */
-    height = img->height;
-    width = img->width;
-    channels = img->nChannels;
-    nbPixels = height * width;
+    /* Name the output: a PNG or GIF may be written as an indexed image */
+    if(strcmp(a.outFile, "") != 0){
+        strcpy(saveName, a.outFile);
+    }
+    else{
+        strcpy(saveName, a.inFile);
+        saveName[strlen(saveName) - strlen(ext) - 1] = '\0';
+        strcat(saveName, "_posterized.");
+        strcat(saveName, ext);
+    }
 
-    /* Alloc everything */
-	origPixels = malloc(nbPixels * sizeof(float *));
-	if(origPixels == NULL){
-		fprintf(stderr, "out of memory\n");
-		return EXIT_FAILURE;
-    }
-	for(i = 0; i < nbPixels; i++){
-		origPixels[i] = malloc(channels * sizeof(float));
-		if(origPixels[i] == NULL){
-			fprintf(stderr, "out of memory\n");
-			return EXIT_FAILURE;
+    /* Read the palette if it is given (an indexed image needs its colors) */
+    memset(&pal, 0, sizeof(palette));
+    if(strcmp(a.paletteFile, "") != 0){
+        if(read_palette(&pal, a.paletteFile) != 0){
+            fprintf(stderr, "ERROR: %s is not a valid palette file\n", 
+                    a.paletteFile);
+            cvReleaseImage(&img);
+            return EXIT_FAILURE;
         }
+        nbColors = pal.nbColors;
     }
-    for(i = 0; i < width; i++){
-        for(j = 0; j < height; j++){
-            uchar blue = CV_IMAGE_ELEM(img, uchar, j, i * 3 + 0);
-            uchar green = CV_IMAGE_ELEM(img, uchar, j, i * 3 + 1);
-            uchar red = CV_IMAGE_ELEM(img, uchar, j, i * 3 + 2);
-            origPixels[i * height + j][0] = red / 255.;
-            origPixels[i * height + j][1] = green / 255.;
-            origPixels[i * height + j][2] = blue / 255.;
-        }
+    else{
+        nbColors = palette_colors(&a.pal);
     }
-	postPixels = malloc(nbPixels * sizeof(float *));
-	if(postPixels == NULL){
-		fprintf(stderr, "out of memory\n");
-		return EXIT_FAILURE;
+    if(a.pal.timeBudget == 0 && nbColors <= INDEXED_MAX_COLORS &&
+       indexed_format(saveName) != INDEXED_NONE){
+        outMemory = indexed_memory(img->width, img->height);
     }
-	for(i = 0; i < nbPixels; i++){
-		postPixels[i] = malloc(channels * sizeof(float));
-		if(postPixels[i] == NULL){
-			fprintf(stderr, "out of memory\n");
-			return EXIT_FAILURE;
-        }
+
+    /* Alloc everything */
+    nbLoaded = job_pixels(&a.pal, nbPixels, img->width, outMemory, 
+                          a.maxMemory);
+    if(nbLoaded == 0 && outMemory > 0){
+        outMemory = 0;          // Saved as a truecolor image instead
+        nbLoaded = job_pixels(&a.pal, nbPixels, img->width, 0, a.maxMemory);
     }
-    for(i = 0; i < width; i++){
-        for(j = 0; j < height; j++){
-            uchar blue = CV_IMAGE_ELEM(img, uchar, j, i * 3 + 0);
-            uchar green = CV_IMAGE_ELEM(img, uchar, j, i * 3 + 1);
-            uchar red = CV_IMAGE_ELEM(img, uchar, j, i * 3 + 2);
-            postPixels[i * height + j][0] = red / 255.;
-            postPixels[i * height + j][1] = green / 255.;
-            postPixels[i * height + j][2] = blue / 255.;
-        }
+    if(nbLoaded == 0){
+        fprintf(stderr, "ERROR: --max-memory is too low, at least %zu "\
+                "bytes are needed\n", 
+                job_memory(&a.pal, img->width, outMemory));
+        palette_free(&pal);
+        cvReleaseImage(&img);
+        return EXIT_FAILURE;
     }
-    trainRes = malloc(channels * sizeof(float *));
-    if(trainRes == NULL){
+    if(arena_init(&mem, job_memory(&a.pal, nbLoaded, outMemory)) != 0){
         fprintf(stderr, "out of memory\n");
+        palette_free(&pal);
+        cvReleaseImage(&img);
         return EXIT_FAILURE;
     }
-    for(i = 0; i < channels; i++){
-        trainRes[i] = malloc(sizeof(float) * nbNeurons);
-        if(trainRes[i] == NULL){
-			fprintf(stderr, "out of memory\n");
-			return EXIT_FAILURE;
-        }
+    a.pal.som.mem = &mem;
+    pixels = arr_alloc_vec4(&mem, nbLoaded);
+    if(nbLoaded < nbPixels){
+        fprintf(stderr, "Memory limit: training on %zu of %u pixels\n", 
+                nbLoaded, nbPixels);
+        arr_sample_IplImage(pixels, img, nbLoaded);
+    }
+    else{
+        arr_from_IplImage(pixels, img, 0, img->height);
     }
 
-    /* Train the network */
-    som_train((float **)trainRes, origPixels, nbPixels, nbNeurons, epochs, 
-              thresh);
+    /* Train the network (unless the palette is given) */
+    start = now_ms();
+    if(a.pal.timeBudget > 0){
+        deadline = now_ms() + a.pal.timeBudget;
+    }
+    if(strcmp(a.paletteFile, "") != 0){
+        fprintf(stderr, "Palette: %d colors read from %s (quantization "\
+                "error: %f)\n", pal.nbColors, a.paletteFile, 
+                palette_qerror(&pal, pixels, nbLoaded));
+    }
+    else if(palette_train(&pal, pixels, nbLoaded, &a.pal, NULL, 
+                          &stats) != SOM_OK){
+        fprintf(stderr, "out of memory\n");
+        arena_release(&mem);
+        cvReleaseImage(&img);
+        return EXIT_FAILURE;
+    }
+    else if(pal.tree){
+        fprintf(stderr, "Hierarchical SOM: %d x %d neurons, %d iterations "\
+                "in %.3f ms (%d colors, quantization error: %f)\n", 
+                pal.h.topNeurons, pal.h.childNeurons, stats.epochs, 
+                now_ms() - start, pal.nbColors, stats.qerror);
+    }
+    else{
+        fprintf(stderr, "Training stopped at epoch %d/%d in %.3f ms "\
+                "(quantization error: %f)\n", stats.epochs, 
+                a.pal.som.noEpoch, now_ms() - start, stats.qerror);
+    }
 
-    /* Posterize the image */
-    som_posterize(postPixels, origPixels, trainRes, nbPixels, nbNeurons);
-    arr_to_IplImage(img, postPixels, height, width, channels);
+    /* Keep the palette indices if the output can be an indexed image (see
+     * indexed.c), the posterized pixels only being displayed then */
+    memset(&out, 0, sizeof(indexed));
+    if(outMemory > 0){
+        res = indexed_init(&out, &pal, img->width, img->height, &mem);
+        if(res == SOM_OK){
+            indices = arena_alloc(&mem, sizeof(unsigned int) * nbLoaded);
+            res = indices != NULL ? SOM_OK : SOM_NO_MEMORY;
+        }
+        if(res == SOM_NO_MEMORY){
+            fprintf(stderr, "out of memory\n");
+            indexed_free(&out);
+            palette_free(&pal);
+            arena_release(&mem);
+            cvReleaseImage(&img);
+            return EXIT_FAILURE;
+        }
+        res = 0;
+    }
+
+    /* Posterize the image (by bands of rows if it does not fit in memory) */
+    if(nbLoaded < nbPixels){
+        nbRows = nbLoaded / img->width;
+        for(row = 0; row < img->height; row += nbRows){
+            nbRows = min(nbRows, img->height - row);
+            arr_from_IplImage(pixels, img, row, nbRows);
+            if(deadline > 0){
+                k = max(k, palette_posterize_until(&pal, pixels, img->width,
+                                                   nbRows, deadline, 
+                                                   a.workers));
+            }
+            else if(out.indices != NULL){
+                palette_index_parallel(&pal, indices, pixels, 
+                                       nbRows * img->width, a.workers);
+                indexed_set(&out, (size_t)row * img->width, indices, 
+                            (size_t)nbRows * img->width);
+            }
+            else{
+                palette_posterize_parallel(&pal, pixels, 
+                                           nbRows * img->width, a.workers);
+            }
+            arr_to_IplImage(img, pixels, row, nbRows);
+        }
+    }
+    else{
+        if(deadline > 0){
+            k = palette_posterize_until(&pal, pixels, img->width, 
+                                        img->height, deadline, a.workers);
+        }
+        else if(out.indices != NULL){
+            palette_index_parallel(&pal, indices, pixels, nbPixels, 
+                                   a.workers);
+            indexed_set(&out, 0, indices, nbPixels);
+        }
+        else{
+            palette_posterize_parallel(&pal, pixels, nbPixels, a.workers);
+        }
+        arr_to_IplImage(img, pixels, 0, img->height);
+    }
+    if(k > 1){
+        fprintf(stderr, "Time budget: preview posterized by blocks of "\
+                "%dx%d pixels\n", k, k);
+    }
 
     /* Display the posterized image */
-    cvNamedWindow("myfirstwindow", CV_WINDOW_AUTOSIZE);
-    cvShowImage("myfirstwindow", img);
-    cvWaitKey(0);
+    if(!a.noDisplay){
+        cvNamedWindow("myfirstwindow", CV_WINDOW_AUTOSIZE);
+        cvShowImage("myfirstwindow", img);
+        cvWaitKey(0);
+    }
 
     /* Save the posterized image */
-    if(strcmp(outFile, "") != 0){
-        cvSaveImage(outFile, img, 0);
+    if(out.indices != NULL){
+        res = indexed_write(&out, saveName);
+        if(res == SOM_NO_MEMORY){
+            fprintf(stderr, "out of memory\n");
+        }
+        else if(res != 0){
+            fprintf(stderr, "ERROR: %s can not be written\n", saveName);
+        }
+        else{
+            fprintf(stderr, "Indexed output: %d colors, %d bits per pixel\n",
+                    out.nbColors, indexed_bits(out.nbColors));
+        }
+        res = res == 0 ? 0 : EXIT_FAILURE;
     }
     else{
-        strcpy(saveName, inFile);
-        saveName[strlen(saveName) - strlen(ext) - 1] = '\0';
-        strcat(saveName, "_posterized.");
-        strcat(saveName, ext);
         cvSaveImage(saveName, img, 0);
     }
+    fprintf(stderr, "Memory: %zu bytes used of %zu\n", mem.peak, mem.size);
     
     /* Free everything */
-	for(i = 0; i < nbPixels; i++){
-        free(origPixels[i]);
-    }
-    free(origPixels);
-	for(i = 0; i < nbPixels; i++){
-        free(postPixels[i]);
-    }
-    free(postPixels);
-    for(i = 0; i < channels; i++){
-        free(trainRes[i]);
-    }
-    free(trainRes);
+    indexed_free(&out);
+    palette_free(&pal);
+    arena_release(&mem);
     cvReleaseImage(&img);
     cvReleaseImageHeader(&img);
     cvDestroyWindow("myfirstwindow");
 
-    return 0;
+    return res;
 }
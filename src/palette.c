@@ -0,0 +1,678 @@
+/**
+ * @file palette.c
+ * @author Mathieu Fourcroy
+ * @date 10/26
+ * @brief Contains functions computing and applying a posterization palette,
+ *  whatever the kind of SOM (flat or hierarchical) it comes from.
+ */
+
+/*=====| INCLUDES |===========================================================*/
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "palette.h"
+#include "arr.h"
+#include "util.h"
+
+/*=====| TYPES |==============================================================*/
+/** A part of the pixels posterized by a thread. */
+typedef struct{
+    const palette *pal;         // The palette
+    float *pixels;              // The RGBA pixels, posterized in place
+    unsigned int *indices;      // The palette index of each pixel (or NULL)
+    unsigned int nbPixels;      // The number of pixels
+} palette_job;
+
+/*=====| FUNCTIONS |==========================================================*/
+/** Set the palette options to their default values.
+ *
+ * @param[out] opts The options to initialize.
+ */
+void palette_opts_init(palette_opts *opts){
+    opts->postLevel = 2;
+    opts->nbRuns = 1;
+    opts->tree = 0;
+    opts->hogwild = 0;
+    opts->timeBudget = 0;
+    som_opts_init(&opts->som);
+}
+
+/** Compute the number of colors of the palette palette_train() makes.
+ *
+ * @param[in] opts The palette options.
+ *
+ * @return The number of colors (see hsom_levels() for a hierarchical SOM).
+ */
+int palette_colors(const palette_opts *opts){
+    int topLevel, childLevel;
+
+    if(opts->tree){
+        hsom_levels(opts->postLevel, &topLevel, &childLevel);
+        return topLevel * topLevel * childLevel * childLevel;
+    }
+    return opts->postLevel * opts->postLevel;
+}
+
+/** Compute the memory palette_train() takes.
+ *
+ * @param[in] opts     The palette options.
+ * @param[in] nbPixels The number of pixels the SOM is trained on.
+ *
+ * @return The size (in bytes) the palette and its training take from their
+ *  arena, including the alignment of every buffer.
+ */
+size_t palette_memory(const palette_opts *opts, unsigned int nbPixels){
+    int nbColors = opts->postLevel * opts->postLevel;
+
+    if(opts->tree){
+        return hsom_memory(opts->postLevel, nbPixels);
+    }
+    if(opts->nbRuns <= 1 && opts->hogwild > 1){
+        return sizeof(float) * PIX_CHANNELS * nbColors + ARENA_ALIGN +
+               som_hogwild_memory(nbColors, opts->hogwild);
+    }
+    return sizeof(float) * PIX_CHANNELS * nbColors + ARENA_ALIGN +
+           som_memory(nbColors, opts->nbRuns);
+}
+
+/** Train a SOM on the given pixels and make a palette of it.
+ *
+ * @param[out] pal      The palette. It must be released with palette_free().
+ * @param[in]  pixels   The image RGBA pixels.
+ * @param[in]  nbPixels The number of pixels.
+ * @param[in]  opts     The palette options. The palette is taken from the
+ *  same arena as the training buffers ('opts->som.mem'). If there is a time
+ *  budget, the training ends within PALETTE_TRAIN_SHARE of it.
+ * @param[in]  ws       The training buffers used by a single flat training.
+ *  Can be NULL (see som_train()).
+ * @param[out] stats    The training statistics. Can be NULL.
+ *
+ * @return SOM_OK if everything goes right or SOM_NO_MEMORY if a memory 
+ *  allocation (malloc) fail.
+ */
+int palette_train(palette *pal, const float *pixels, unsigned int nbPixels,
+                  const palette_opts *opts, som_workspace *ws, 
+                  som_stats *stats){
+    som_opts somOpts = opts->som;
+    som_stats localStats;
+    int res;
+
+    if(opts->timeBudget > 0){
+        somOpts.deadline = now_ms() + opts->timeBudget * PALETTE_TRAIN_SHARE;
+    }
+    if(stats == NULL){
+        stats = &localStats;
+    }
+    memset(pal, 0, sizeof(palette));
+    pal->tree = opts->tree;
+    pal->mem = opts->som.mem;
+    if(opts->tree){
+        if(hsom_init(&pal->h, opts->postLevel, pal->mem) != SOM_OK){
+            return SOM_NO_MEMORY;
+        }
+        pal->nbColors = pal->h.topNeurons * pal->h.childNeurons;
+        pal->colors = pal->h.children;
+        res = hsom_train(&pal->h, pixels, nbPixels, &somOpts, stats);
+    }
+    else{
+        pal->nbColors = opts->postLevel * opts->postLevel;
+        pal->colors = arr_alloc_vec4(pal->mem, pal->nbColors);
+        if(pal->colors == NULL){
+            return SOM_NO_MEMORY;
+        }
+        if(opts->nbRuns > 1){
+            res = som_train_best(pal->colors, pixels, nbPixels, pal->nbColors,
+                                 &somOpts, opts->nbRuns, stats);
+        }
+        else if(opts->hogwild > 1){
+            res = som_train_hogwild(pal->colors, pixels, nbPixels, 
+                                    pal->nbColors, &somOpts, opts->hogwild,
+                                    stats);
+        }
+        else{
+            res = som_train(pal->colors, pixels, nbPixels, pal->nbColors,
+                            &somOpts, ws, stats);
+        }
+    }
+    if(res != SOM_OK){
+        palette_free(pal);
+    }
+    else{
+        pal->qerror = stats->qerror;
+    }
+    return res;
+}
+
+/** Copy a palette.
+ *
+ * @param[out] dst The copy, on the heap whatever the memory of 'src' is. It
+ *  must be released with palette_free().
+ * @param[in]  src The palette to copy.
+ *
+ * @return SOM_OK if everything goes right or SOM_NO_MEMORY if a memory 
+ *  allocation (malloc) fail.
+ */
+int palette_copy(palette *dst, const palette *src){
+    *dst = *src;
+    dst->mem = NULL;
+    dst->h.mem = NULL;
+    dst->colors = arr_alloc_vec4(NULL, src->nbColors);
+    if(dst->colors == NULL){
+        return SOM_NO_MEMORY;
+    }
+    memcpy(dst->colors, src->colors, 
+           sizeof(float) * PIX_CHANNELS * src->nbColors);
+    if(src->tree){
+        dst->h.children = dst->colors;
+        dst->h.top = arr_alloc_vec4(NULL, src->h.topNeurons);
+        if(dst->h.top == NULL){
+            free(dst->colors);
+            return SOM_NO_MEMORY;
+        }
+        memcpy(dst->h.top, src->h.top, 
+               sizeof(float) * PIX_CHANNELS * src->h.topNeurons);
+    }
+    return SOM_OK;
+}
+
+/** Release a palette.
+ *
+ * @param[in,out] pal The palette.
+ */
+void palette_free(palette *pal){
+    if(pal->tree){
+        hsom_free(&pal->h);
+    }
+    else{
+        arena_free(pal->mem, pal->colors);
+    }
+    pal->colors = NULL;
+}
+
+/** Find the color of the palette which is the nearest of a given vector.
+ *
+ * @param[in] pal The palette.
+ * @param[in] v   The RGBA vector.
+ *
+ * @return The index of the color in 'pal->colors'.
+ */
+size_t palette_nearest(const palette *pal, const float *v){
+    if(pal->tree){
+        return hsom_nearest(&pal->h, v);
+    }
+    return arr_nearest(pal->colors, pal->nbColors, v);
+}
+
+/** Measure the quantization error of pixels with a palette.
+ *
+ * Like the error measured at the end of a training (see som_qerror()), it is
+ * the mean distance of SOM_QE_SAMPLES pixels to their palette color, the 
+ * pixels being picked at regular intervals.
+ *
+ * @param[in] pal      The palette.
+ * @param[in] pixels   The RGBA pixels.
+ * @param[in] nbPixels The number of pixels.
+ *
+ * @return The quantization error.
+ */
+float palette_qerror(const palette *pal, const float *pixels, 
+                     unsigned int nbPixels){
+    unsigned int nbSample = min(nbPixels, SOM_QE_SAMPLES);
+    unsigned int i;
+    const float *px;
+    double sum = 0.;
+
+    for(i = 0; i < nbSample; i++){
+        px = &pixels[(size_t)i * nbPixels / nbSample * PIX_CHANNELS];
+        sum += sqrt(vec4_dist(
+            &pal->colors[palette_nearest(pal, px) * PIX_CHANNELS], px));
+    }
+    return nbSample > 0 ? sum / nbSample : 0.;
+}
+
+/** Posterize pixels with a palette.
+ *
+ * @note 'postPixels' and 'origPixels' can be the same array.
+ *
+ * @param[in]  pal        The palette.
+ * @param[out] postPixels The posterized RGBA pixels.
+ * @param[in]  origPixels The original RGBA pixels.
+ * @param[in]  nbPixels   The number of pixels.
+ */
+void palette_posterize(const palette *pal, float *postPixels, 
+                       const float *origPixels, unsigned int nbPixels){
+    if(pal->tree){
+        hsom_posterize(postPixels, origPixels, &pal->h, nbPixels);
+    }
+    else{
+        som_posterize(postPixels, origPixels, pal->colors, nbPixels, 
+                      pal->nbColors);
+    }
+}
+
+/** Posterize an image with a palette before a deadline.
+ *
+ * The time a pixel takes is measured on the first PALETTE_PROBE_PIXELS 
+ * pixels. If the rest of the image can not be posterized by 'nbThreads' 
+ * threads before the deadline, a downscaled preview is posterized instead:
+ * only one pixel of each 'k' x 'k' block is looked up in the palette and its
+ * color is given to the whole block (nearest neighbour upscaling). 'k' is 
+ * the smallest block size that fits in the time left.
+ *
+ * @param[in]     pal       The palette.
+ * @param[in,out] pixels    The RGBA pixels, posterized in place.
+ * @param[in]     width     The width of the image.
+ * @param[in]     height    The height of the image.
+ * @param[in]     deadline  The now_ms() time to be done by (0 for none).
+ * @param[in]     nbThreads The number of threads.
+ *
+ * @return The size of the blocks: 1 if every pixel was looked up.
+ */
+int palette_posterize_until(const palette *pal, float *pixels, int width, 
+                            int height, double deadline, int nbThreads){
+    unsigned int nbPixels = (unsigned int)width * height;
+    unsigned int nbProbe = min(nbPixels, PALETTE_PROBE_PIXELS);
+    unsigned int nbSamples;
+    double start = now_ms();
+    double cost;                // Projected time of the rest of the pixels
+    float *samples;             // One pixel of each block of the preview
+    const float *color;
+    int k = 1;                  // Size of the blocks
+    int x, y, i, j, s;
+
+    if(nbPixels == 0){
+        return 1;
+    }
+    if(deadline <= 0){
+        palette_posterize_parallel(pal, pixels, nbPixels, nbThreads);
+        return 1;
+    }
+    palette_posterize(pal, pixels, pixels, nbProbe);
+    nbPixels -= nbProbe;
+    cost = (now_ms() - start) * nbPixels / nbProbe / 
+           max(min(nbThreads, (int)(nbPixels / PALETTE_THREAD_PIXELS)), 1);
+    if(cost <= deadline - now_ms()){
+        palette_posterize_parallel(pal, &pixels[nbProbe * PIX_CHANNELS], 
+                                   nbPixels, nbThreads);
+        return 1;
+    }
+
+    /* Downscaled preview */
+    k = (int)ceil(sqrt(cost / max(deadline - now_ms(), 1e-3)));
+    k = min(max(k, 2), max(width, height));
+    nbSamples = (unsigned int)((width + k - 1) / k) * ((height + k - 1) / k);
+    samples = arr_alloc_vec4(NULL, nbSamples);
+    if(samples != NULL){
+        for(y = 0, s = 0; y < height; y += k){
+            for(x = 0; x < width; x += k, s++){
+                memcpy(&samples[s * PIX_CHANNELS], 
+                       &pixels[(y * width + x) * PIX_CHANNELS],
+                       sizeof(float) * PIX_CHANNELS);
+            }
+        }
+        palette_posterize_parallel(pal, samples, nbSamples, nbThreads);
+    }
+    for(y = 0, s = 0; y < height; y += k){
+        for(x = 0; x < width; x += k, s++){
+            if(samples != NULL){
+                color = &samples[s * PIX_CHANNELS];
+            }
+            else{               // Look the pixel up in this thread
+                color = &pal->colors[palette_nearest(pal, 
+                    &pixels[(y * width + x) * PIX_CHANNELS]) * PIX_CHANNELS];
+            }
+            for(j = y; j < min(y + k, height); j++){
+                for(i = x; i < min(x + k, width); i++){
+                    memcpy(&pixels[(j * width + i) * PIX_CHANNELS], color,
+                           sizeof(float) * PIX_CHANNELS);
+                }
+            }
+        }
+    }
+    free(samples);
+    return k;
+}
+
+/** Find the palette color of each pixel.
+ *
+ * @param[in]  pal      The palette.
+ * @param[out] indices  The index of the palette color of each pixel.
+ * @param[in]  pixels   The RGBA pixels.
+ * @param[in]  nbPixels The number of pixels.
+ */
+void palette_index(const palette *pal, unsigned int *indices, 
+                   const float *pixels, unsigned int nbPixels){
+    unsigned int i;
+
+    for(i = 0; i < nbPixels; i++){
+        indices[i] = palette_nearest(pal, &pixels[i * PIX_CHANNELS]);
+    }
+}
+
+/** Paint pixels with the palette colors of their indices.
+ *
+ * @param[in]  pal        The palette.
+ * @param[out] postPixels The posterized RGBA pixels.
+ * @param[in]  indices    The index of the palette color of each pixel (see
+ *  palette_index()).
+ * @param[in]  nbPixels   The number of pixels.
+ */
+void palette_render(const palette *pal, float *postPixels, 
+                    const unsigned int *indices, unsigned int nbPixels){
+    unsigned int i;
+
+    for(i = 0; i < nbPixels; i++){
+        memcpy(&postPixels[i * PIX_CHANNELS], 
+               &pal->colors[indices[i] * PIX_CHANNELS], 
+               sizeof(float) * PIX_CHANNELS);
+    }
+}
+
+/** Map the pixels of rectangles of an image to a palette.
+ *
+ * @param[in]     pal     The palette.
+ * @param[in,out] indices The palette color index of each pixel of the image.
+ * @param[in]     pixels  The RGBA pixels of the image.
+ * @param[in]     width   The width of the image.
+ * @param[in]     rects   The rectangles (within the image).
+ * @param[in]     nbRects The number of rectangles.
+ *
+ * @return The quantization error of the pixels of the rectangles.
+ */
+static float palette_index_rects(const palette *pal, unsigned int *indices,
+                                 const float *pixels, int width, 
+                                 const palette_rect *rects, int nbRects){
+    const float *px;
+    size_t idx;
+    size_t count = 0;
+    double sum = 0.;
+    int r, x, y;
+
+    for(r = 0; r < nbRects; r++){
+        for(y = rects[r].y; y < rects[r].y + rects[r].height; y++){
+            for(x = rects[r].x; x < rects[r].x + rects[r].width; x++){
+                idx = (size_t)y * width + x;
+                px = &pixels[idx * PIX_CHANNELS];
+                indices[idx] = palette_nearest(pal, px);
+                sum += sqrt(vec4_dist(
+                    &pal->colors[indices[idx] * PIX_CHANNELS], px));
+                count++;
+            }
+        }
+    }
+    return count > 0 ? sum / count : 0.;
+}
+
+/** Fine tune a flat palette on the pixels of rectangles of an image.
+ *
+ * The SOM is trained for a few iterations from the end of its schedules on
+ * the pixels of the rectangles along with as many pixels picked at regular
+ * intervals over the whole image, so that the colors of the rest of the 
+ * image are not forgotten.
+ *
+ * @param[in,out] pal        The palette.
+ * @param[in]     pixels     The RGBA pixels of the image.
+ * @param[in]     width      The width of the image.
+ * @param[in]     height     The height of the image.
+ * @param[in]     rects      The rectangles (within the image).
+ * @param[in]     nbRects    The number of rectangles.
+ * @param[in]     warmEpochs The number of iterations.
+ * @param[in]     opts       The training options.
+ *
+ * @return SOM_OK if everything goes right or SOM_NO_MEMORY if a memory 
+ *  allocation (malloc) fail.
+ */
+static int palette_tune(palette *pal, const float *pixels, int width, 
+                        int height, const palette_rect *rects, int nbRects,
+                        int warmEpochs, const som_opts *opts){
+    som_opts tuneOpts = *opts;
+    size_t nbPixels = (size_t)width * height;
+    size_t nbDirty = 0;
+    size_t i, k = 0;
+    float *train;               // Pixels the palette is tuned on
+    int r, y, res;
+
+    for(r = 0; r < nbRects; r++){
+        nbDirty += (size_t)rects[r].width * rects[r].height;
+    }
+    nbDirty = min(nbDirty, nbPixels / 2);
+    if(nbDirty == 0){
+        return SOM_OK;
+    }
+    train = arr_alloc_vec4(NULL, 2 * nbDirty);
+    if(train == NULL){
+        return SOM_NO_MEMORY;
+    }
+    for(r = 0; r < nbRects && k < nbDirty; r++){
+        for(y = rects[r].y; y < rects[r].y + rects[r].height && 
+            k < nbDirty; y++){
+            i = min((size_t)rects[r].width, nbDirty - k);
+            memcpy(&train[k * PIX_CHANNELS], 
+                   &pixels[((size_t)y * width + rects[r].x) * PIX_CHANNELS],
+                   sizeof(float) * PIX_CHANNELS * i);
+            k += i;
+        }
+    }
+    for(i = 0; i < nbDirty; i++){
+        memcpy(&train[(nbDirty + i) * PIX_CHANNELS], 
+               &pixels[i * nbPixels / nbDirty * PIX_CHANNELS],
+               sizeof(float) * PIX_CHANNELS);
+    }
+
+    tuneOpts.noEpoch = warmEpochs;
+    tuneOpts.startStep = PALETTE_TUNE_STEP;
+    tuneOpts.mem = NULL;
+    res = som_train(pal->colors, train, 2 * nbDirty, pal->nbColors, &tuneOpts,
+                    NULL, NULL);
+    free(train);
+    return res;
+}
+
+/** Update a posterization after some parts of the image changed.
+ *
+ * Only the pixels of the dirty rectangles are mapped to the palette again,
+ * so the cost is proportional to the size of the change rather than to the 
+ * size of the image. The palette is still valid if the quantization error of
+ * these pixels is at most PALETTE_STALE_RATIO times the one of its training.
+ * Otherwise a flat palette is fine tuned with 'warmEpochs' iterations (see 
+ * palette_tune()) and checked again. As the colors then change, the whole 
+ * image is painted again from the indices of its pixels (a copy, without 
+ * any distance computation). The other pixels keep their index, which is an
+ * approximation as long as the palette only moved a little.
+ *
+ * @param[in,out] pal        The palette of the previous posterization.
+ * @param[in,out] postPixels The posterized RGBA pixels of the image.
+ * @param[in,out] indices    The palette color index of each pixel of the 
+ *  image (see palette_index()).
+ * @param[in]     origPixels The RGBA pixels of the changed image.
+ * @param[in]     width      The width of the image.
+ * @param[in]     height     The height of the image.
+ * @param[in]     rects      The dirty rectangles. They are clipped to the
+ *  image.
+ * @param[in]     nbRects    The number of dirty rectangles.
+ * @param[in]     warmEpochs The number of fine tuning iterations (0 to never
+ *  fine tune the palette).
+ * @param[in]     opts       The fine tuning options.
+ *
+ * @return PALETTE_KEPT if the palette is still valid, PALETTE_TUNED if it was 
+ *  fine tuned (the whole image was painted again), PALETTE_STALE if it is no
+ *  longer valid (the image must be posterized from scratch) or 
+ *  SOM_NO_MEMORY if a memory allocation (malloc) fail.
+ */
+int palette_update(palette *pal, float *postPixels, unsigned int *indices,
+                   const float *origPixels, int width, int height,
+                   const palette_rect *rects, int nbRects, int warmEpochs,
+                   const som_opts *opts){
+    palette_rect *clipped;      // The dirty rectangles within the image
+    float qerror;               // Quantization error of the dirty pixels
+    int nbClipped = 0;
+    int res = PALETTE_KEPT;
+    int r, y;
+
+    clipped = malloc(sizeof(palette_rect) * max(nbRects, 1));
+    if(clipped == NULL){
+        return SOM_NO_MEMORY;
+    }
+    for(r = 0; r < nbRects; r++){
+        clipped[nbClipped].x = max(rects[r].x, 0);
+        clipped[nbClipped].y = max(rects[r].y, 0);
+        clipped[nbClipped].width = 
+            min(rects[r].x + rects[r].width, width) - clipped[nbClipped].x;
+        clipped[nbClipped].height = 
+            min(rects[r].y + rects[r].height, height) - clipped[nbClipped].y;
+        if(clipped[nbClipped].width > 0 && clipped[nbClipped].height > 0){
+            nbClipped++;
+        }
+    }
+    if(nbClipped == 0){
+        free(clipped);
+        return PALETTE_KEPT;
+    }
+
+    qerror = palette_index_rects(pal, indices, origPixels, width, clipped, 
+                                 nbClipped);
+    if(qerror > pal->qerror * PALETTE_STALE_RATIO){
+        res = PALETTE_STALE;
+        if(warmEpochs > 0 && !pal->tree){
+            if(palette_tune(pal, origPixels, width, height, clipped, 
+                            nbClipped, warmEpochs, opts) != SOM_OK){
+                free(clipped);
+                return SOM_NO_MEMORY;
+            }
+            qerror = palette_index_rects(pal, indices, origPixels, width, 
+                                         clipped, nbClipped);
+            if(qerror <= pal->qerror * PALETTE_STALE_RATIO){
+                palette_render(pal, postPixels, indices, 
+                               (unsigned int)width * height);
+                res = PALETTE_TUNED;
+            }
+        }
+    }
+    if(res == PALETTE_KEPT){
+        for(r = 0; r < nbClipped; r++){
+            for(y = clipped[r].y; y < clipped[r].y + clipped[r].height; y++){
+                palette_render(pal, &postPixels[((size_t)y * width + 
+                                                 clipped[r].x) * PIX_CHANNELS],
+                               &indices[(size_t)y * width + clipped[r].x], 
+                               clipped[r].width);
+            }
+        }
+    }
+
+    free(clipped);
+    return res;
+}
+
+/** Posterize a part of the pixels (thread entry point).
+ *
+ * @param[in,out] arg The job (palette_job).
+ *
+ * @return NULL.
+ */
+static void *palette_posterize_thread(void *arg){
+    palette_job *job = arg;
+    size_t k;
+    unsigned int i;
+
+    if(job->indices == NULL){
+        palette_posterize(job->pal, job->pixels, job->pixels, job->nbPixels);
+        return NULL;
+    }
+    for(i = 0; i < job->nbPixels; i++){
+        k = palette_nearest(job->pal, &job->pixels[i * PIX_CHANNELS]);
+        job->indices[i] = k;
+        memcpy(&job->pixels[i * PIX_CHANNELS], 
+               &job->pal->colors[k * PIX_CHANNELS], 
+               sizeof(float) * PIX_CHANNELS);
+    }
+    return NULL;
+}
+
+/** Posterize pixels with a palette using several threads, keeping the 
+ * palette index of each pixel if asked.
+ *
+ * The pixels are split into 'nbThreads' contiguous parts posterized 
+ * concurrently. If a thread can not be started, its part is posterized by
+ * the calling thread.
+ *
+ * @param[in]     pal       The palette.
+ * @param[out]    indices   The palette index of each pixel, or NULL.
+ * @param[in,out] pixels    The RGBA pixels, posterized in place.
+ * @param[in]     nbPixels  The number of pixels.
+ * @param[in]     nbThreads The number of threads.
+ */
+static void palette_parallel(const palette *pal, unsigned int *indices, 
+                             float *pixels, unsigned int nbPixels,
+                             int nbThreads){
+    palette_job *jobs;
+    pthread_t *threads;
+    int *started;               // Whether each thread was started
+    unsigned int first;
+    int i;
+
+    nbThreads = max(min(nbThreads, (int)(nbPixels / PALETTE_THREAD_PIXELS)),
+                    1);
+    jobs = malloc(sizeof(palette_job) * nbThreads);
+    threads = malloc(sizeof(pthread_t) * nbThreads);
+    started = calloc(nbThreads, sizeof(int));
+    if(nbThreads == 1 || jobs == NULL || threads == NULL || started == NULL){
+        palette_job job = {pal, pixels, indices, nbPixels};
+
+        palette_posterize_thread(&job);
+        free(jobs);
+        free(threads);
+        free(started);
+        return;
+    }
+    for(i = 0; i < nbThreads; i++){
+        first = (unsigned int)((size_t)nbPixels * i / nbThreads);
+        jobs[i].pal = pal;
+        jobs[i].pixels = &pixels[(size_t)first * PIX_CHANNELS];
+        jobs[i].indices = indices != NULL ? &indices[first] : NULL;
+        jobs[i].nbPixels = 
+            (unsigned int)((size_t)nbPixels * (i + 1) / nbThreads) - first;
+        started[i] = pthread_create(&threads[i], NULL, 
+                                    palette_posterize_thread, &jobs[i]) == 0;
+        if(!started[i]){
+            palette_posterize_thread(&jobs[i]);
+        }
+    }
+    for(i = 0; i < nbThreads; i++){
+        if(started[i]){
+            pthread_join(threads[i], NULL);
+        }
+    }
+    free(jobs);
+    free(threads);
+    free(started);
+}
+
+/** Posterize pixels with a palette using several threads.
+ *
+ * @param[in]     pal       The palette.
+ * @param[in,out] pixels    The RGBA pixels, posterized in place.
+ * @param[in]     nbPixels  The number of pixels.
+ * @param[in]     nbThreads The number of threads.
+ */
+void palette_posterize_parallel(const palette *pal, float *pixels, 
+                                unsigned int nbPixels, int nbThreads){
+    palette_parallel(pal, NULL, pixels, nbPixels, nbThreads);
+}
+
+/** Find the palette color of each pixel and posterize them using several
+ * threads.
+ *
+ * This is palette_index() posterizing the pixels in place as well, or 
+ * palette_posterize_parallel() keeping the indices of the colors lookup.
+ *
+ * @param[in]     pal       The palette.
+ * @param[out]    indices   The index of the palette color of each pixel.
+ * @param[in,out] pixels    The RGBA pixels, posterized in place.
+ * @param[in]     nbPixels  The number of pixels.
+ * @param[in]     nbThreads The number of threads.
+ */
+void palette_index_parallel(const palette *pal, unsigned int *indices, 
+                            float *pixels, unsigned int nbPixels, 
+                            int nbThreads){
+    palette_parallel(pal, indices, pixels, nbPixels, nbThreads);
+}
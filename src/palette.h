@@ -0,0 +1,79 @@
+#ifndef _PALETTE_H_
+#define _PALETTE_H_
+
+/*====| INCLUDES |============================================================*/
+#include <stdlib.h>
+#include "som.h"
+#include "hsom.h"
+
+/*====| DEFINES |=============================================================*/
+#define PALETTE_TRAIN_SHARE 0.5     // Part of the time budget for training
+#define PALETTE_PROBE_PIXELS 4096   // Pixels timed to project the mapping
+#define PALETTE_THREAD_PIXELS 4096  // Minimum pixels of a mapping thread
+#define PALETTE_STALE_RATIO 1.5     // Error increase making a palette stale
+#define PALETTE_TUNE_STEP 0.9       // Schedules progress of a fine tuning
+#define PALETTE_KEPT 0              // palette_update() results
+#define PALETTE_TUNED 1
+#define PALETTE_STALE 2
+
+/*====| TYPES |===============================================================*/
+/** How to compute a palette (see palette_opts_init() for the defaults). */
+typedef struct{
+    int postLevel;      // Posterization level (level^2 colors)
+    int nbRuns;         // Number of concurrent trainings (flat SOM only)
+    int tree;           // Whether to use a hierarchical SOM
+    int hogwild;        // Threads sharing a single training (flat SOM only,
+                        // unless nbRuns is used)
+    double timeBudget;  // Time limit of a posterization in ms (0: none)
+    som_opts som;       // The SOM training options
+} palette_opts;
+
+/** The colors of a posterization: the weights of a trained SOM. */
+typedef struct{
+    int nbColors;       // Number of colors of the palette
+    float *colors;      // RGBA colors (the SOM weight vectors)
+    int tree;           // Whether it comes from a hierarchical SOM
+    float qerror;       // Quantization error of the training
+    arena *mem;         // Memory the colors are taken from
+    hsom h;             // The hierarchical SOM (if 'tree')
+} palette;
+
+/** A rectangle of pixels of an image. */
+typedef struct{
+    int x;              // Abscissa of the top left pixel
+    int y;              // Ordinate of the top left pixel
+    int width;
+    int height;
+} palette_rect;
+
+/*====| PROTOTYPES |==========================================================*/
+void palette_opts_init(palette_opts *opts);
+int palette_colors(const palette_opts *opts);
+size_t palette_memory(const palette_opts *opts, unsigned int nbPixels);
+int palette_train(palette *pal, const float *pixels, unsigned int nbPixels,
+                  const palette_opts *opts, som_workspace *ws, 
+                  som_stats *stats);
+int palette_copy(palette *dst, const palette *src);
+void palette_free(palette *pal);
+size_t palette_nearest(const palette *pal, const float *v);
+float palette_qerror(const palette *pal, const float *pixels, 
+                     unsigned int nbPixels);
+void palette_posterize(const palette *pal, float *postPixels, 
+                       const float *origPixels, unsigned int nbPixels);
+int palette_posterize_until(const palette *pal, float *pixels, int width, 
+                            int height, double deadline, int nbThreads);
+void palette_index(const palette *pal, unsigned int *indices, 
+                   const float *pixels, unsigned int nbPixels);
+void palette_render(const palette *pal, float *postPixels, 
+                    const unsigned int *indices, unsigned int nbPixels);
+void palette_posterize_parallel(const palette *pal, float *pixels, 
+                                unsigned int nbPixels, int nbThreads);
+void palette_index_parallel(const palette *pal, unsigned int *indices, 
+                            float *pixels, unsigned int nbPixels, 
+                            int nbThreads);
+int palette_update(palette *pal, float *postPixels, unsigned int *indices,
+                   const float *origPixels, int width, int height,
+                   const palette_rect *rects, int nbRects, int warmEpochs,
+                   const som_opts *opts);
+
+#endif
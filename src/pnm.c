@@ -0,0 +1,150 @@
+/**
+ * @file pnm.c
+ * @author Mathieu Fourcroy
+ * @date 10/26
+ * @brief Contains functions reading and writing the headers of the Netpbm
+ *  formats (PGM, PPM and PAM) so that frames can be streamed through pipes
+ *  without any image codec.
+ *
+ * @see http://netpbm.sourceforge.net/doc/
+ */
+
+/*=====| INCLUDES |===========================================================*/
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "pnm.h"
+
+/*=====| DEFINES |============================================================*/
+#define PNM_TOKEN_MAX 64    // Size of a header token
+
+/*=====| FUNCTIONS |==========================================================*/
+/** Read the next token of a PNM header, skipping white spaces and comments.
+ *
+ * The single white space character following the token is consumed, as the
+ * formats require before the pixels data.
+ *
+ * @param[in]  f     The stream.
+ * @param[out] token The token (PNM_TOKEN_MAX bytes).
+ *
+ * @return 1 if a token was read, 0 otherwise.
+ */
+static int pnm_token(FILE *f, char *token){
+    int c = fgetc(f);
+    int len = 0;
+
+    while(c != EOF && (isspace(c) || c == '#')){
+        if(c == '#'){
+            while(c != EOF && c != '\n'){
+                c = fgetc(f);
+            }
+        }
+        c = fgetc(f);
+    }
+    while(c != EOF && !isspace(c) && len < PNM_TOKEN_MAX - 1){
+        token[len++] = c;
+        c = fgetc(f);
+    }
+    token[len] = '\0';
+    return len > 0;
+}
+
+/** Read the header of the next frame of a PNM stream.
+ *
+ * The format is detected from the magic number (P5, P6 or P7). Only 8 bits
+ * samples (maximum value of 255) are supported. For a PNM_RAW stream there is
+ * no header: the given dimensions are kept and the function only checks
+ * whether there is another frame.
+ *
+ * @param[in]     f The stream, positioned at the beginning of a frame.
+ * @param[in,out] h The frame description. Its 'format' must be set to
+ *  PNM_RAW (with the dimensions) or to anything else to read a header.
+ *
+ * @return 1 if a frame header was read, 0 at the end of the stream or -1 if
+ *  the header is invalid.
+ */
+int pnm_read_header(FILE *f, pnm_header *h){
+    char token[PNM_TOKEN_MAX];
+    char value[PNM_TOKEN_MAX];
+    int maxval = 0;
+    int c;
+
+    if(h->format == PNM_RAW){
+        c = fgetc(f);
+        if(c == EOF){
+            return 0;
+        }
+        ungetc(c, f);
+        return 1;
+    }
+    if(!pnm_token(f, token)){
+        return 0;
+    }
+    if(strcmp(token, "P5") == 0 || strcmp(token, "P6") == 0){
+        h->format = token[1] - '0';
+        h->channels = h->format == PNM_PPM ? 3 : 1;
+        if(!pnm_token(f, token)){
+            return -1;
+        }
+        h->width = atoi(token);
+        if(!pnm_token(f, token)){
+            return -1;
+        }
+        h->height = atoi(token);
+        if(!pnm_token(f, token)){
+            return -1;
+        }
+        maxval = atoi(token);
+    }
+    else if(strcmp(token, "P7") == 0){
+        h->format = PNM_PAM;
+        h->width = h->height = h->channels = 0;
+        while(pnm_token(f, token) && strcmp(token, "ENDHDR") != 0){
+            if(!pnm_token(f, value)){
+                return -1;
+            }
+            if(strcmp(token, "WIDTH") == 0){
+                h->width = atoi(value);
+            }
+            else if(strcmp(token, "HEIGHT") == 0){
+                h->height = atoi(value);
+            }
+            else if(strcmp(token, "DEPTH") == 0){
+                h->channels = atoi(value);
+            }
+            else if(strcmp(token, "MAXVAL") == 0){
+                maxval = atoi(value);
+            }
+        }
+    }
+    else{
+        return -1;
+    }
+    if(h->width <= 0 || h->height <= 0 || maxval != 255 ||
+       (h->channels != 1 && h->channels != 3 && h->channels != 4)){
+        return -1;
+    }
+    return 1;
+}
+
+/** Write the header of a frame of a PNM stream.
+ *
+ * @param[in] f The stream.
+ * @param[in] h The frame description. Nothing is written for PNM_RAW.
+ *
+ * @return 0 if everything goes right or -1 if the header can not be written.
+ */
+int pnm_write_header(FILE *f, const pnm_header *h){
+    static const char *tupltypes[] = {"", "GRAYSCALE", "", "RGB", "RGB_ALPHA"};
+    int res = 0;
+
+    if(h->format == PNM_PGM || h->format == PNM_PPM){
+        res = fprintf(f, "P%d\n%d %d\n255\n", h->format, h->width, h->height);
+    }
+    else if(h->format == PNM_PAM){
+        res = fprintf(f, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL 255\n"\
+                      "TUPLTYPE %s\nENDHDR\n", h->width, h->height, 
+                      h->channels, tupltypes[h->channels]);
+    }
+    return res < 0 ? -1 : 0;
+}
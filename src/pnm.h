@@ -0,0 +1,26 @@
+#ifndef _PNM_H_
+#define _PNM_H_
+
+/*====| INCLUDES |============================================================*/
+#include <stdio.h>
+
+/*====| DEFINES |=============================================================*/
+#define PNM_RAW 0   // Headerless interleaved pixels
+#define PNM_PGM 5   // Binary graymap (P5)
+#define PNM_PPM 6   // Binary pixmap (P6)
+#define PNM_PAM 7   // Portable arbitrary map (P7)
+
+/*====| TYPES |===============================================================*/
+/** The description of a frame of a PNM stream. */
+typedef struct{
+    int format;     // PNM_RAW, PNM_PGM, PNM_PPM or PNM_PAM
+    int width;      // Width of the frame (in pixels)
+    int height;     // Height of the frame (in pixels)
+    int channels;   // Number of channels (1: gray, 3: RGB, 4: RGBA)
+} pnm_header;
+
+/*====| PROTOTYPES |==========================================================*/
+int pnm_read_header(FILE *f, pnm_header *h);
+int pnm_write_header(FILE *f, const pnm_header *h);
+
+#endif
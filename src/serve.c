@@ -0,0 +1,585 @@
+/**
+ * @file serve.c
+ * @author Mathieu Fourcroy
+ * @date 10/26
+ * @brief Contains the posterization server (posternn --serve).
+ *
+ * The server listens on a Unix domain socket. Each worker thread accepts a
+ * connection and answers its requests until the client closes it. A request
+ * is a single text line:
+ *  - "POSTERIZE <level> <epochs> <input_path> <output_path>": posterize an
+ *    image file and save the result (the paths must not contain spaces and
+ *    are shorter than PATH_MAX);
+ *  - "RAW <level> <epochs> <width> <height> <channels>" followed by
+ *    width * height * channels bytes of interleaved gray, RGB or RGBA pixels:
+ *    posterize the pixels;
+ *  - "QUIT": close the connection.
+ * A level or a number of epochs of 0 selects the server default. They can not
+ * be greater than SERVE_MAX_LEVEL and SERVE_MAX_EPOCHS, and an image can not
+ * have more than SERVE_MAX_PIXELS pixels.
+ *
+ * The answer is either "ERR <message>" or 
+ * "OK <total_ms> <train_ms> <map_ms> <epochs> <qerror> <cached>" followed, for
+ * a RAW request, by the posterized pixels (same size as the request ones). A
+ * cached palette is reported with 0 epochs and the quantization error of its
+ * training. The pixels of a rejected RAW request are skipped, unless its 
+ * dimensions are invalid: their size is unknown then, so the connection is
+ * closed after the answer.
+ *
+ * The workers keep their training buffers and pixel buffers from one request
+ * to the next. The palettes are cached, keyed by the image (path, modification
+ * time and size, or content hash for raw pixels) and the training options, so
+ * posterizing the same image again skips the training.
+ *
+ * If the server has a time budget (--time-budget), every request is answered
+ * within about that time: the training is cut short and a big image may be
+ * posterized as a downscaled preview (see palette_posterize_until()).
+ */
+
+/*=====| INCLUDES |===========================================================*/
+#include <opencv/highgui.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "serve.h"
+#include "arr.h"
+#include "util.h"
+
+/*=====| DEFINES |============================================================*/
+#define SERVE_CACHE_SIZE 16                 // Number of cached palettes
+#define SERVE_KEY_MAX (PATH_MAX + 128)      // Size of a cache key
+#define SERVE_LINE_MAX (2 * PATH_MAX + 64)  // Size of a request line
+#define SERVE_STR(x) #x                     // Stringify a macro value
+#define SERVE_XSTR(x) SERVE_STR(x)
+#define SERVE_PATH_FMT "%" SERVE_XSTR(PATH_MAX) "s" // Bounded path field
+#define SERVE_MAX_LEVEL 64                  // Highest level of a request
+#define SERVE_MAX_EPOCHS 10000000           // Most iterations of a request
+#define SERVE_MAX_PIXELS (1 << 26)          // Most pixels of a request image
+#define SERVE_SKIP_CHUNK 4096               // Bytes skipped at a time
+
+/*=====| TYPES |==============================================================*/
+/** A cached palette. */
+typedef struct{
+    char key[SERVE_KEY_MAX];    // The image and options it was trained for
+    palette pal;                // The palette
+    double lastUse;             // Last time it was used (for eviction)
+} cache_entry;
+
+/** The state shared by the workers. */
+typedef struct{
+    int listenFd;                           // The listening socket
+    const palette_opts *defaults;           // Default training options
+    pthread_mutex_t cacheLock;              // Protects 'cache'
+    cache_entry cache[SERVE_CACHE_SIZE];    // The cached palettes
+    int cacheCount;                         // Number of cached palettes
+} server;
+
+/** The state of a worker, kept warm from one request to the next. */
+typedef struct{
+    server *srv;                // The server
+    int id;                     // The worker number
+    som_workspace ws;           // Training buffers
+    float *pixels;              // RGBA pixels buffer
+    size_t capacity;            // Number of vectors of 'pixels'
+    unsigned char *bytes;       // Raw pixels buffer
+    size_t bytesCapacity;       // Size of 'bytes'
+} worker;
+
+/** What a request cost. */
+typedef struct{
+    double trainMs;             // Time spent getting the palette
+    double mapMs;               // Time spent posterizing the pixels
+    som_stats som;              // Training statistics (qerror only if cached)
+    int cached;                 // Whether the palette came from the cache
+} request_stats;
+
+/*=====| FUNCTIONS |==========================================================*/
+/** Look for a palette in the cache.
+ *
+ * @param[in,out] srv The server.
+ * @param[in]     key The cache key.
+ * @param[out]    pal A copy of the cached palette (if found). It must be 
+ *  released with palette_free().
+ *
+ * @return 1 if the palette was found, 0 otherwise.
+ */
+static int cache_get(server *srv, const char *key, palette *pal){
+    int found = 0;
+    int i;
+
+    pthread_mutex_lock(&srv->cacheLock);
+    for(i = 0; i < srv->cacheCount; i++){
+        if(strcmp(srv->cache[i].key, key) == 0){
+            found = palette_copy(pal, &srv->cache[i].pal) == SOM_OK;
+            srv->cache[i].lastUse = now_ms();
+            break;
+        }
+    }
+    pthread_mutex_unlock(&srv->cacheLock);
+    return found;
+}
+
+/** Add a palette to the cache, evicting the least recently used one if the
+ * cache is full.
+ *
+ * @param[in,out] srv The server.
+ * @param[in]     key The cache key.
+ * @param[in]     pal The palette (it is copied).
+ */
+static void cache_put(server *srv, const char *key, const palette *pal){
+    cache_entry *entry;
+    palette copy;
+    int i;
+
+    if(palette_copy(&copy, pal) != SOM_OK){
+        return;
+    }
+    pthread_mutex_lock(&srv->cacheLock);
+    if(srv->cacheCount < SERVE_CACHE_SIZE){
+        entry = &srv->cache[srv->cacheCount++];
+    }
+    else{
+        entry = &srv->cache[0];
+        for(i = 1; i < SERVE_CACHE_SIZE; i++){
+            if(srv->cache[i].lastUse < entry->lastUse){
+                entry = &srv->cache[i];
+            }
+        }
+        palette_free(&entry->pal);
+    }
+    strncpy(entry->key, key, SERVE_KEY_MAX - 1);
+    entry->key[SERVE_KEY_MAX - 1] = '\0';
+    entry->pal = copy;
+    entry->lastUse = now_ms();
+    pthread_mutex_unlock(&srv->cacheLock);
+}
+
+/** Apply the level and number of epochs of a request to the options.
+ *
+ * @param[in,out] opts   The training options (the server defaults).
+ * @param[in]     level  The level of the request (0 for the default).
+ * @param[in]     epochs The number of epochs of the request (0 for the 
+ *  default).
+ *
+ * @return NULL if everything goes right or an error message.
+ */
+static const char *serve_options(palette_opts *opts, int level, int epochs){
+    if(level < 0 || level > SERVE_MAX_LEVEL){
+        return "invalid level";
+    }
+    if(epochs < 0 || epochs > SERVE_MAX_EPOCHS){
+        return "invalid number of epochs";
+    }
+    opts->postLevel = level > 0 ? level : opts->postLevel;
+    opts->som.noEpoch = epochs > 0 ? epochs : opts->som.noEpoch;
+    return NULL;
+}
+
+/** Skip the pixels of a rejected RAW request.
+ *
+ * @param[in] in   The connection, positioned on the pixels.
+ * @param[in] size The size of the pixels data.
+ *
+ * @return 0 if everything goes right, -1 if the data is truncated.
+ */
+static int serve_skip(FILE *in, size_t size){
+    char buf[SERVE_SKIP_CHUNK];
+    size_t len;
+
+    while(size > 0){
+        len = size < SERVE_SKIP_CHUNK ? size : SERVE_SKIP_CHUNK;
+        if(fread(buf, 1, len, in) != len){
+            return -1;
+        }
+        size -= len;
+    }
+    return 0;
+}
+
+/** Make sure the pixels buffer of a worker is big enough.
+ *
+ * @param[in,out] w        The worker.
+ * @param[in]     nbPixels The number of pixels the buffer must hold.
+ *
+ * @return SOM_OK if everything goes right or SOM_NO_MEMORY if a memory 
+ *  allocation (malloc) fail.
+ */
+static int worker_reserve(worker *w, size_t nbPixels){
+    if(nbPixels <= w->capacity){
+        return SOM_OK;
+    }
+    free(w->pixels);
+    w->pixels = arr_alloc_vec4(NULL, nbPixels);
+    w->capacity = w->pixels != NULL ? nbPixels : 0;
+    return w->pixels != NULL ? SOM_OK : SOM_NO_MEMORY;
+}
+
+/** Posterize the pixels held by a worker.
+ *
+ * The palette is taken from the cache if possible, trained otherwise.
+ *
+ * @param[in,out] w        The worker. Its 'pixels' are posterized in place.
+ * @param[in]     width    The width of the image.
+ * @param[in]     height   The height of the image.
+ * @param[in]     opts     The training options (the time budget bounds the
+ *  training and the mapping, see palette_posterize_until()).
+ * @param[in]     key      The cache key of the image.
+ * @param[out]    stats    What the request cost.
+ *
+ * @return SOM_OK if everything goes right or SOM_NO_MEMORY if a memory 
+ *  allocation (malloc) fail.
+ */
+static int worker_posterize(worker *w, int width, int height, 
+                            const palette_opts *opts, const char *key,
+                            request_stats *stats){
+    char fullKey[SERVE_KEY_MAX];
+    unsigned int nbPixels = (unsigned int)width * height;
+    int nbNeurons = opts->postLevel * opts->postLevel;
+    palette pal;
+    double start = now_ms();
+    double deadline = opts->timeBudget > 0 ? start + opts->timeBudget : 0;
+
+    snprintf(fullKey, SERVE_KEY_MAX, "%s|%d|%d|%d|%d", key, opts->postLevel,
+             opts->som.noEpoch, opts->tree, opts->nbRuns);
+    memset(stats, 0, sizeof(request_stats));
+    stats->cached = cache_get(w->srv, fullKey, &pal);
+    if(!stats->cached){
+        if(w->ws.nbNeurons < nbNeurons){
+            som_workspace_free(&w->ws);
+            if(som_workspace_init(&w->ws, nbNeurons, NULL) != SOM_OK){
+                return SOM_NO_MEMORY;
+            }
+        }
+        if(palette_train(&pal, w->pixels, nbPixels, opts, &w->ws, 
+                         &stats->som) != SOM_OK){
+            return SOM_NO_MEMORY;
+        }
+        cache_put(w->srv, fullKey, &pal);
+    }
+    else{
+        stats->som.qerror = pal.qerror;     // The quality of what is served
+    }
+    stats->trainMs = now_ms() - start;
+
+    start = now_ms();
+    palette_posterize_until(&pal, w->pixels, width, height, deadline, 1);
+    stats->mapMs = now_ms() - start;
+
+    palette_free(&pal);
+    return SOM_OK;
+}
+
+/** Handle a POSTERIZE request.
+ *
+ * @param[in,out] w     The worker.
+ * @param[in]     opts  The training options.
+ * @param[in]     in    The input image path.
+ * @param[in]     out   The output image path.
+ * @param[out]    stats What the request cost.
+ *
+ * @return NULL if everything goes right or an error message.
+ */
+static const char *handle_file(worker *w, const palette_opts *opts,
+                               const char *in, const char *out, 
+                               request_stats *stats){
+    char key[SERVE_KEY_MAX];
+    struct stat st;
+    IplImage *img;
+    unsigned int nbPixels;
+    const char *err = NULL;
+
+    if(stat(in, &st) != 0){
+        return "input file not found";
+    }
+    img = arr_IplImage_8U(cvLoadImage(in, CV_LOAD_IMAGE_UNCHANGED));
+    if(img == NULL){
+        return "image can not be loaded";
+    }
+    nbPixels = img->height * img->width;
+    if((size_t)img->width * img->height > SERVE_MAX_PIXELS){
+        err = "image too big";
+    }
+    else if(worker_reserve(w, nbPixels) != SOM_OK){
+        err = "out of memory";
+    }
+    else{
+        snprintf(key, SERVE_KEY_MAX, "%s|%ld|%ld", in, (long)st.st_mtime,
+                 (long)st.st_size);
+        arr_from_IplImage(w->pixels, img, 0, img->height);
+        if(worker_posterize(w, img->width, img->height, opts, key, 
+                            stats) != SOM_OK){
+            err = "out of memory";
+        }
+        else{
+            arr_to_IplImage(img, w->pixels, 0, img->height);
+            if(!cvSaveImage(out, img, 0)){
+                err = "image can not be saved";
+            }
+        }
+    }
+    cvReleaseImage(&img);
+    return err;
+}
+
+/** Handle a RAW request.
+ *
+ * @param[in,out] w        The worker. The posterized pixels are left in its
+ *  'bytes' buffer.
+ * @param[in]     opts     The training options.
+ * @param[in]     in       The connection, positioned on the pixels. They are
+ *  read (or skipped) whatever the error, unless the data is truncated.
+ * @param[in]     size     The size of the pixels data.
+ * @param[in]     width    The width of the image.
+ * @param[in]     height   The height of the image (width * height is at 
+ *  most SERVE_MAX_PIXELS).
+ * @param[in]     channels The number of channels of a pixel.
+ * @param[out]    stats    What the request cost.
+ *
+ * @return NULL if everything goes right or an error message.
+ */
+static const char *handle_raw(worker *w, const palette_opts *opts, FILE *in,
+                              size_t size, int width, int height,
+                              int channels, request_stats *stats){
+    char key[SERVE_KEY_MAX];
+    unsigned int nbPixels = (unsigned int)width * height;
+    unsigned long long hash = 14695981039346656037ULL;
+    size_t i;
+
+    if(size > w->bytesCapacity){
+        free(w->bytes);
+        w->bytes = malloc(size);
+        w->bytesCapacity = w->bytes != NULL ? size : 0;
+        if(w->bytes == NULL){
+            return serve_skip(in, size) == 0 ? "out of memory" : 
+                   "truncated pixels data";
+        }
+    }
+    if(fread(w->bytes, 1, size, in) != size){
+        return "truncated pixels data";
+    }
+    if(worker_reserve(w, nbPixels) != SOM_OK){
+        return "out of memory";
+    }
+
+    /* FNV-1a hash of the pixels as the cache key */
+    for(i = 0; i < size; i++){
+        hash = (hash ^ w->bytes[i]) * 1099511628211ULL;
+    }
+    snprintf(key, SERVE_KEY_MAX, "raw|%016llx|%u|%d", hash, nbPixels, 
+             channels);
+
+    arr_from_bytes(w->pixels, w->bytes, nbPixels, channels);
+    if(worker_posterize(w, width, height, opts, key, stats) != SOM_OK){
+        return "out of memory";
+    }
+    arr_to_bytes(w->bytes, w->pixels, nbPixels, channels);
+    return NULL;
+}
+
+/** Answer the requests of a connection until the client closes it.
+ *
+ * @param[in,out] w  The worker.
+ * @param[in]     fd The connection socket.
+ */
+static void serve_connection(worker *w, int fd){
+    char line[SERVE_LINE_MAX];
+    char in[PATH_MAX + 1];      // One more byte to detect too long paths
+    char out[PATH_MAX + 1];
+    palette_opts opts;
+    request_stats stats;
+    const char *err;
+    int level, epochs, width, height, channels;
+    int quit;                   // Whether to close the connection
+    size_t size = 0;
+    double start;
+    FILE *rd = fdopen(fd, "r");
+    FILE *wr = fdopen(dup(fd), "w");
+
+    if(rd == NULL || wr == NULL){
+        if(rd != NULL){
+            fclose(rd);
+        }
+        else{
+            close(fd);
+        }
+        if(wr != NULL){
+            fclose(wr);
+        }
+        return;
+    }
+
+    while(fgets(line, SERVE_LINE_MAX, rd) != NULL){
+        start = now_ms();
+        opts = *w->srv->defaults;
+        size = 0;
+        quit = 0;
+        if(strncmp(line, "QUIT", 4) == 0){
+            break;
+        }
+        else if(sscanf(line, "POSTERIZE %d %d " SERVE_PATH_FMT " " 
+                       SERVE_PATH_FMT, &level, &epochs, in, out) == 4){
+            if(strlen(in) >= PATH_MAX || strlen(out) >= PATH_MAX){
+                err = "path too long";
+            }
+            else if((err = serve_options(&opts, level, epochs)) == NULL){
+                err = handle_file(w, &opts, in, out, &stats);
+            }
+        }
+        else if(sscanf(line, "RAW %d %d %d %d %d", &level, &epochs, &width,
+                       &height, &channels) == 5){
+            if(width <= 0 || height <= 0 || 
+               width > SERVE_MAX_PIXELS / height ||
+               (channels != 1 && channels != 3 && channels != 4)){
+                err = "invalid image dimensions";
+                quit = 1;       // The pixels can not be skipped
+            }
+            else{
+                size = (size_t)width * height * channels;
+                err = serve_options(&opts, level, epochs);
+                if(err != NULL){
+                    quit = serve_skip(rd, size) != 0;
+                }
+                else{
+                    err = handle_raw(w, &opts, rd, size, width, height, 
+                                     channels, &stats);
+                }
+                if(err != NULL && strcmp(err, "truncated pixels data") == 0){
+                    break;
+                }
+            }
+        }
+        else{
+            err = "unknown request";
+        }
+
+        if(err != NULL){
+            fprintf(wr, "ERR %s\n", err);
+        }
+        else{
+            fprintf(wr, "OK %.3f %.3f %.3f %d %f %d\n", now_ms() - start,
+                    stats.trainMs, stats.mapMs, stats.som.epochs,
+                    stats.som.qerror, stats.cached);
+            if(size > 0){
+                fwrite(w->bytes, 1, size, wr);
+            }
+            fprintf(stderr, "[worker %d] %.3f ms (train %.3f ms%s, map "\
+                    "%.3f ms)\n", w->id, now_ms() - start, stats.trainMs,
+                    stats.cached ? " cached" : "", stats.mapMs);
+        }
+        if(fflush(wr) != 0 || quit){
+            break;
+        }
+    }
+    fclose(rd);
+    fclose(wr);
+}
+
+/** Worker thread routine: accept and serve connections forever.
+ *
+ * @param[in,out] arg The worker.
+ *
+ * @return NULL.
+ */
+static void *worker_thread(void *arg){
+    worker *w = arg;
+    int fd;
+
+    while(1){
+        fd = accept(w->srv->listenFd, NULL, NULL);
+        if(fd < 0){
+            if(errno == EINTR || errno == ECONNABORTED){
+                continue;
+            }
+            perror("accept");
+            break;
+        }
+        serve_connection(w, fd);
+    }
+    return NULL;
+}
+
+/** Run the posterization server.
+ *
+ * The function only returns if the server can not be started or if every
+ * worker has stopped on an error.
+ *
+ * @param[in] path      The path of the Unix domain socket to listen on. An
+ *  existing file at this path is removed.
+ * @param[in] nbWorkers The number of worker threads.
+ * @param[in] defaults  The default training options of the requests.
+ *
+ * @return 0 if the server stopped normally, -1 if it could not be started.
+ */
+int serve(const char *path, int nbWorkers, const palette_opts *defaults){
+    struct sockaddr_un addr;
+    server srv;
+    worker *workers;
+    pthread_t *threads;
+    int started;
+    int i;
+
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        fprintf(stderr, "ERROR: socket path is too long\n");
+        return -1;
+    }
+    memset(&srv, 0, sizeof(server));
+    srv.defaults = defaults;
+    pthread_mutex_init(&srv.cacheLock, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    srv.listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(srv.listenFd < 0){
+        perror("socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if(bind(srv.listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+       listen(srv.listenFd, 64) != 0){
+        perror(path);
+        close(srv.listenFd);
+        return -1;
+    }
+
+    workers = calloc(nbWorkers, sizeof(worker));
+    threads = malloc(sizeof(pthread_t) * nbWorkers);
+    if(workers == NULL || threads == NULL){
+        fprintf(stderr, "out of memory\n");
+        free(workers);
+        free(threads);
+        close(srv.listenFd);
+        return -1;
+    }
+    for(started = 0; started < nbWorkers; started++){
+        workers[started].srv = &srv;
+        workers[started].id = started;
+        if(pthread_create(&threads[started], NULL, worker_thread, 
+                          &workers[started]) != 0){
+            break;
+        }
+    }
+    fprintf(stderr, "Listening on %s with %d workers\n", path, started);
+
+    for(i = 0; i < started; i++){
+        pthread_join(threads[i], NULL);
+        som_workspace_free(&workers[i].ws);
+        free(workers[i].pixels);
+        free(workers[i].bytes);
+    }
+    for(i = 0; i < srv.cacheCount; i++){
+        palette_free(&srv.cache[i].pal);
+    }
+    free(workers);
+    free(threads);
+    close(srv.listenFd);
+    unlink(path);
+    pthread_mutex_destroy(&srv.cacheLock);
+    return 0;
+}
@@ -0,0 +1,10 @@
+#ifndef _SERVE_H_
+#define _SERVE_H_
+
+/*====| INCLUDES |============================================================*/
+#include "palette.h"
+
+/*====| PROTOTYPES |==========================================================*/
+int serve(const char *path, int nbWorkers, const palette_opts *defaults);
+
+#endif
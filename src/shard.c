@@ -0,0 +1,348 @@
+/**
+ * @file shard.c
+ * @author Mathieu Fourcroy
+ * @date 10/26
+ * @brief Contains functions to train a palette over several processes, each
+ *  one seeing a shard (a band of rows) of the image.
+ *
+ * Each process trains a SOM on its shard and sums up the result as weighted
+ * colors: the mean of the pixels matched by each neuron and their number.
+ * These sufficient statistics are written to a small text file:
+ *
+ *     posternn-palette 1
+ *     <number of colors>
+ *     <weight> <red> <green> <blue> <alpha>
+ *     ...
+ *
+ * one line per color, the colors being premultiplied RGBA values between 0
+ * and 1. The merge step pools the weighted colors of every shard, trains a
+ * SOM on them (picked in proportion of their weights) and refines it with
+ * weighted k-means passes. As a weighted color stands for all the pixels it
+ * matched, these passes work like k-means passes over the pixels of the 
+ * whole image, the pixels of a shard color just being moved together. The 
+ * result uses the same format, so the merges can themselves be merged, and 
+ * is the palette of the mapping pass.
+ */
+
+/*=====| INCLUDES |===========================================================*/
+#include <stdio.h>
+#include <string.h>
+#include "shard.h"
+#include "arr.h"
+
+/*=====| FUNCTIONS |==========================================================*/
+/** Allocate the colors of a shard.
+ *
+ * @param[out] s        The shard. It must be released with shard_free().
+ * @param[in]  nbColors The number of colors.
+ *
+ * @return SOM_OK if everything goes right or SOM_NO_MEMORY if a memory
+ *  allocation (malloc) fail.
+ */
+int shard_init(shard *s, int nbColors){
+    s->nbColors = nbColors;
+    s->colors = arr_alloc_vec4(NULL, nbColors);
+    s->weights = calloc(nbColors, sizeof(double));
+    if(s->colors == NULL || s->weights == NULL){
+        shard_free(s);
+        return SOM_NO_MEMORY;
+    }
+    return SOM_OK;
+}
+
+/** Release the colors of a shard.
+ *
+ * @param[in,out] s The shard.
+ */
+void shard_free(shard *s){
+    free(s->colors);
+    free(s->weights);
+    memset(s, 0, sizeof(shard));
+}
+
+/** Compute the weighted colors of pixels posterized with a palette.
+ *
+ * Each color is the mean of the pixels whose nearest palette color it
+ * replaces (a k-means pass), its weight is their number. A palette color
+ * which matches no pixel keeps its value with a weight of 0.
+ *
+ * @param[out] s        The shard. It must be released with shard_free().
+ * @param[in]  pal      The palette.
+ * @param[in]  pixels   The RGBA pixels.
+ * @param[in]  nbPixels The number of pixels.
+ *
+ * @return SOM_OK if everything goes right or SOM_NO_MEMORY if a memory
+ *  allocation (malloc) fail.
+ */
+int shard_from_palette(shard *s, const palette *pal, const float *pixels,
+                       unsigned int nbPixels){
+    double *sums;               // Sum of the pixels matched by each color
+    size_t k;
+    unsigned int i;
+    int c, j;
+
+    if(shard_init(s, pal->nbColors) != SOM_OK){
+        return SOM_NO_MEMORY;
+    }
+    sums = calloc((size_t)pal->nbColors * PIX_CHANNELS, sizeof(double));
+    if(sums == NULL){
+        shard_free(s);
+        return SOM_NO_MEMORY;
+    }
+    for(i = 0; i < nbPixels; i++){
+        k = palette_nearest(pal, &pixels[i * PIX_CHANNELS]);
+        for(j = 0; j < PIX_CHANNELS; j++){
+            sums[k * PIX_CHANNELS + j] += pixels[i * PIX_CHANNELS + j];
+        }
+        s->weights[k]++;
+    }
+    for(c = 0; c < pal->nbColors; c++){
+        for(j = 0; j < PIX_CHANNELS; j++){
+            s->colors[c * PIX_CHANNELS + j] = s->weights[c] > 0 ?
+                sums[c * PIX_CHANNELS + j] / s->weights[c] :
+                pal->colors[c * PIX_CHANNELS + j];
+        }
+    }
+    free(sums);
+    return SOM_OK;
+}
+
+/** Make a flat palette of the colors of a shard.
+ *
+ * @param[out] pal The palette. It must be released with palette_free().
+ * @param[in]  s   The shard.
+ *
+ * @return SOM_OK if everything goes right or SOM_NO_MEMORY if a memory
+ *  allocation (malloc) fail.
+ */
+int shard_to_palette(palette *pal, const shard *s){
+    memset(pal, 0, sizeof(palette));
+    pal->nbColors = s->nbColors;
+    pal->colors = arr_alloc_vec4(NULL, s->nbColors);
+    if(pal->colors == NULL){
+        return SOM_NO_MEMORY;
+    }
+    memcpy(pal->colors, s->colors,
+           sizeof(float) * PIX_CHANNELS * s->nbColors);
+    return SOM_OK;
+}
+
+/** Write a shard to a file.
+ *
+ * @param[in] s    The shard.
+ * @param[in] path The path of the file.
+ *
+ * @return 0 if everything goes right, -1 otherwise (errno is set).
+ */
+int shard_write(const shard *s, const char *path){
+    FILE *f;
+    int c, res;
+
+    f = fopen(path, "w");
+    if(f == NULL){
+        return -1;
+    }
+    fprintf(f, "%s %d\n%d\n", SHARD_MAGIC, SHARD_VERSION, s->nbColors);
+    for(c = 0; c < s->nbColors; c++){
+        fprintf(f, "%.17g %.9g %.9g %.9g %.9g\n", s->weights[c],
+                s->colors[c * PIX_CHANNELS], s->colors[c * PIX_CHANNELS + 1],
+                s->colors[c * PIX_CHANNELS + 2],
+                s->colors[c * PIX_CHANNELS + 3]);
+    }
+    res = ferror(f) ? -1 : 0;
+    if(fclose(f) != 0){
+        res = -1;
+    }
+    return res;
+}
+
+/** Read a shard from a file (see shard_write()).
+ *
+ * @param[out] s    The shard. It must be released with shard_free().
+ * @param[in]  path The path of the file.
+ *
+ * @return 0 if everything goes right, -1 if the file can not be opened or is
+ *  not a valid shard file, SOM_NO_MEMORY if a memory allocation (malloc)
+ *  fail.
+ */
+int shard_read(shard *s, const char *path){
+    char magic[32];
+    int version, nbColors;
+    float *px;
+    FILE *f;
+    int c;
+    int res = 0;
+
+    f = fopen(path, "r");
+    if(f == NULL){
+        return -1;
+    }
+    if(fscanf(f, "%31s %d %d", magic, &version, &nbColors) != 3 ||
+       strcmp(magic, SHARD_MAGIC) != 0 || version != SHARD_VERSION ||
+       nbColors <= 0){
+        fclose(f);
+        return -1;
+    }
+    if(shard_init(s, nbColors) != SOM_OK){
+        fclose(f);
+        return SOM_NO_MEMORY;
+    }
+    for(c = 0; c < nbColors && res == 0; c++){
+        px = &s->colors[c * PIX_CHANNELS];
+        if(fscanf(f, "%lf %f %f %f %f", &s->weights[c], &px[0], &px[1],
+                  &px[2], &px[3]) != 5 || s->weights[c] < 0){
+            res = -1;
+        }
+    }
+    fclose(f);
+    if(res != 0){
+        shard_free(s);
+    }
+    return res;
+}
+
+/** Move the top level map of a hierarchical palette to the weighted mean of
+ * each of its child maps, so that colors are routed to their child map again
+ * after the child maps moved.
+ *
+ * @param[in,out] pal     The hierarchical palette.
+ * @param[in]     weights The number of pixels matched by each palette color.
+ */
+static void shard_update_top(palette *pal, const double *weights){
+    double sum[PIX_CHANNELS];
+    double total;
+    int k, c, j;
+
+    for(k = 0; k < pal->h.topNeurons; k++){
+        memset(sum, 0, sizeof(sum));
+        total = 0.;
+        for(c = k * pal->h.childNeurons; c < (k + 1) * pal->h.childNeurons;
+            c++){
+            for(j = 0; j < PIX_CHANNELS; j++){
+                sum[j] += weights[c] * pal->colors[c * PIX_CHANNELS + j];
+            }
+            total += weights[c];
+        }
+        if(total > 0){
+            for(j = 0; j < PIX_CHANNELS; j++){
+                pal->h.top[k * PIX_CHANNELS + j] = sum[j] / total;
+            }
+        }
+    }
+}
+
+/** Merge shards into a single palette.
+ *
+ * The weighted colors of every shard are pooled. SHARD_MERGE_SAMPLES of them
+ * are picked at regular intervals of the cumulated weights (so each color is
+ * picked in proportion of its weight) and a palette is trained on them with
+ * the given options. It is then refined by SHARD_MERGE_ITERS weighted k-means
+ * passes over the pooled colors. With a hierarchical palette, the top level
+ * map is moved along with the child maps after each pass (see
+ * shard_update_top()).
+ *
+ * @param[out] res      The merged shard: the palette colors and the total
+ *  weight they match. It must be released with shard_free().
+ * @param[in]  shards   The shards.
+ * @param[in]  nbShards The number of shards.
+ * @param[in]  opts     The palette options.
+ *
+ * @return SOM_OK if everything goes right, -1 if the shards match no pixel
+ *  or SOM_NO_MEMORY if a memory allocation (malloc) fail.
+ */
+int shard_merge(shard *res, const shard *shards, int nbShards,
+                const palette_opts *opts){
+    palette_opts mergeOpts = *opts;
+    palette pal;
+    double total = 0.;          // Total weight of the shards
+    double next;                // Cumulated weight of the next sample
+    double cumul = 0.;          // Cumulated weight of the colors so far
+    double *sums;               // Weighted sum of the colors of each neuron
+    float *samples;             // Colors the palette is trained on
+    const float *color;
+    size_t k;
+    int nbSamples = 0;
+    int i, c, j, it;
+
+    for(i = 0; i < nbShards; i++){
+        for(c = 0; c < shards[i].nbColors; c++){
+            total += shards[i].weights[c];
+        }
+    }
+    if(total <= 0){
+        return -1;
+    }
+
+    /* Pick the training colors in proportion of their weights */
+    samples = arr_alloc_vec4(NULL, SHARD_MERGE_SAMPLES);
+    if(samples == NULL){
+        return SOM_NO_MEMORY;
+    }
+    next = 0.5 * total / SHARD_MERGE_SAMPLES;
+    for(i = 0; i < nbShards; i++){
+        for(c = 0; c < shards[i].nbColors; c++){
+            cumul += shards[i].weights[c];
+            while(next < cumul && nbSamples < SHARD_MERGE_SAMPLES){
+                memcpy(&samples[nbSamples * PIX_CHANNELS],
+                       &shards[i].colors[c * PIX_CHANNELS],
+                       sizeof(float) * PIX_CHANNELS);
+                nbSamples++;
+                next += total / SHARD_MERGE_SAMPLES;
+            }
+        }
+    }
+
+    /* Train the merged palette */
+    mergeOpts.timeBudget = 0;
+    mergeOpts.som.mem = NULL;
+    if(palette_train(&pal, samples, nbSamples, &mergeOpts, NULL,
+                     NULL) != SOM_OK){
+        free(samples);
+        return SOM_NO_MEMORY;
+    }
+    free(samples);
+    if(shard_init(res, pal.nbColors) != SOM_OK){
+        palette_free(&pal);
+        return SOM_NO_MEMORY;
+    }
+    sums = calloc((size_t)pal.nbColors * PIX_CHANNELS, sizeof(double));
+    if(sums == NULL){
+        shard_free(res);
+        palette_free(&pal);
+        return SOM_NO_MEMORY;
+    }
+
+    /* Weighted k-means passes */
+    for(it = 0; it < SHARD_MERGE_ITERS; it++){
+        memset(sums, 0, sizeof(double) * pal.nbColors * PIX_CHANNELS);
+        memset(res->weights, 0, sizeof(double) * pal.nbColors);
+        for(i = 0; i < nbShards; i++){
+            for(c = 0; c < shards[i].nbColors; c++){
+                color = &shards[i].colors[c * PIX_CHANNELS];
+                k = palette_nearest(&pal, color);
+                for(j = 0; j < PIX_CHANNELS; j++){
+                    sums[k * PIX_CHANNELS + j] +=
+                        shards[i].weights[c] * color[j];
+                }
+                res->weights[k] += shards[i].weights[c];
+            }
+        }
+        for(c = 0; c < pal.nbColors; c++){
+            if(res->weights[c] > 0){
+                for(j = 0; j < PIX_CHANNELS; j++){
+                    pal.colors[c * PIX_CHANNELS + j] =
+                        sums[c * PIX_CHANNELS + j] / res->weights[c];
+                }
+            }
+        }
+        if(pal.tree){
+            shard_update_top(&pal, res->weights);
+        }
+    }
+    memcpy(res->colors, pal.colors,
+           sizeof(float) * PIX_CHANNELS * pal.nbColors);
+
+    free(sums);
+    palette_free(&pal);
+    return SOM_OK;
+}
@@ -0,0 +1,35 @@
+#ifndef _SHARD_H_
+#define _SHARD_H_
+
+/*====| INCLUDES |============================================================*/
+#include <stdlib.h>
+#include "palette.h"
+
+/*====| DEFINES |=============================================================*/
+#define SHARD_MAGIC "posternn-palette"  // First word of a shard file
+#define SHARD_VERSION 1                 // Version of the shard file format
+#define SHARD_LEVEL_FACTOR 2            // Shard palettes are that much finer
+#define SHARD_MERGE_SAMPLES 65536       // Pixels the merged SOM is trained on
+#define SHARD_MERGE_ITERS 10            // Refinement passes of a merge
+
+/*====| TYPES |===============================================================*/
+/** The sufficient statistics of a posterization: weighted colors. Each color
+ * is the mean of the pixels it matched and its weight is their number. */
+typedef struct{
+    int nbColors;       // Number of colors
+    float *colors;      // RGBA colors (premultiplied)
+    double *weights;    // Number of pixels of each color
+} shard;
+
+/*====| PROTOTYPES |==========================================================*/
+int shard_init(shard *s, int nbColors);
+void shard_free(shard *s);
+int shard_from_palette(shard *s, const palette *pal, const float *pixels,
+                       unsigned int nbPixels);
+int shard_to_palette(palette *pal, const shard *s);
+int shard_write(const shard *s, const char *path);
+int shard_read(shard *s, const char *path);
+int shard_merge(shard *res, const shard *shards, int nbShards,
+                const palette_opts *opts);
+
+#endif
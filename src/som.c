@@ -11,26 +11,73 @@
 #include <time.h>
 #include <math.h>
 #include <limits.h>
+#include <pthread.h>
 #include "som.h"
 #include "arr.h"
 #include "util.h"
 
+/*=====| TYPES |==============================================================*/
+/** Arguments and result of one of the trainings of som_train_best(). */
+typedef struct{
+    float *weights;             // The SOM weight vectors
+    const float *imgPixels;     // The image pixels
+    unsigned int nbPixels;      // The number of pixels of the image
+    int nbNeurons;              // The number of neurons of the SOM
+    som_opts opts;              // The training options (with its own seed)
+    const unsigned int *sample; // The pixels used to score the SOM
+    unsigned int nbSample;      // The size of the 'sample' array
+    som_stats stats;            // The training statistics
+    float score;                // The quantization error over 'sample'
+    int res;                    // som_train() return value
+} som_run;
+
+/** The radius and learning rate schedules of a training. They go from 
+ * 'step' at iteration 'start' to 1 at iteration 'start' + 'length', and are
+ * shortened by the plateaus and the deadline (see som_train()). */
+typedef struct{
+    float step;                 // Progress when the schedules were rescaled
+    int start;                  // Iteration when the schedules were rescaled
+    int length;                 // Iterations from 'start' to the end
+} som_schedule;
+
+/** The state shared by the threads of som_train_hogwild(). */
+typedef struct{
+    float *weights;             // The shared SOM weight vectors
+    const float *imgPixels;     // The image pixels
+    unsigned int nbPixels;      // The number of pixels of the image
+    int nbNeurons;              // The number of neurons of the SOM
+    const som_opts *opts;       // The training options
+    int it;                     // Iterations started so far (atomic)
+    double start;               // When the training started
+    som_schedule sched;         // The schedules (under 'lock')
+    int version;                // Number of 'sched' changes (atomic)
+    pthread_mutex_t lock;       // Protect 'sched'
+} som_hogwild;
+
+/** One of the threads of som_train_hogwild(). */
+typedef struct{
+    som_hogwild *shared;        // The shared state
+    float *neigh;               // Neighbooring mask of the thread
+    unsigned int seed;          // Random number generator state
+    som_schedule sched;         // Copy of the shared schedules
+    int version;                // Version of the copy
+} som_hogwild_thread;
+
 /*=====| FUNCTIONS |==========================================================*/
 /** Compute and returns the neighbour radius value.
  *
- * The radius is computed given the current iteration number, the maximum 
- * iteration number and the dimmensions of the network.
+ * The radius is computed given the training progress and the dimmensions of
+ * the network.
  *
- * @param[in] iterNo    The number of the current iteration.
- * @param[in] iterCount The maximum number of iterations.
- * @param[in] width     The width of the network.
- * @param[in] height     The height of the network.
+ * @param[in] step   The training progress, from 0 (first iteration) to 1
+ *  (usually the current iteration number over the maximum iteration number).
+ * @param[in] width  The width of the network.
+ * @param[in] height The height of the network.
  *
  * @return The computed radius.
  */
-static float som_radius(int iterNo, int iterCount, int width, int height){
+static float som_radius(float step, int width, int height){
     float totalrange = max(width, height) / 2.;
-    float step = iterNo / (float)iterCount;
 
     // Quadratic function (**2 can be changed for different function)
     return totalrange - pow(step, 2) * totalrange;
@@ -38,88 +85,22 @@ static float som_radius(int iterNo, int iterCount, int width, int height){
 
 /** Compute and returns the learning rate of the network.
  *
- * The learning rate is a function of the current iteration number over the 
- * maximum iterations number and a given range.
+ * The learning rate is a function of the training progress (the current
+ * iteration number over the maximum iterations number) and a given range.
  *
- * @param[in] iterNo    The number of the current iteration.
- * @param[in] iterCount The maximum number of iterations.
+ * @param[in] step The training progress, from 0 to 1.
  *
  * @return The computed learning rate.
  */
-static float som_learning_rate(int iterNo, int iterCount){
+static float som_learning_rate(float step){
     float MAX_VALUE = 0.75;
     float MIN_VALUE = 0.1;
     float totalrange = MAX_VALUE - MIN_VALUE;
-    float step = iterNo / (float)iterCount;
 
     // Linear function
     return MAX_VALUE - step * totalrange;
 }
 
-/** Compute the Euclidian distance between weight vectors and input vector.
- *
- * The Euclidean distance between points p and q is the length of the line 
- * segment connecting them.
- *
- * @see https://en.wikipedia.org/wiki/Euclidean_distance.
- *
- * The two points here are (x, y, z) and (RGB[0], RGB[1], RGB[2]).
- *
- * @param[out] res  The array which will contain the euclidian distance. It must
- *  be of size 'size'.
- * @param[in]  size Size of the 'x', 'y', 'z' and 'res' arrays.
- * @param[in]  x    The x 3D coordinates.
- * @param[in]  y    The y 3D coordinates.
- * @param[in]  z    The z 3D coordinates.
- * @param[in]  RGB  The array containing the three channels values, treated as
- *  coordinates.
- *
- * @return SOM_OK if everything goes right or SOM_NO_MEMORY if a memory 
- *  allocation (malloc) fail.
- */
-static int euclidian(float *res, size_t size, float *x, float *y, float *z,
-                     float *RGB){
-    float *xsub = malloc(sizeof(float) * size);
-	if(xsub == NULL){
-		return SOM_NO_MEMORY;
-    }
-    float *ysub = malloc(sizeof(float) * size);
-	if(ysub == NULL){
-		return SOM_NO_MEMORY;
-    }
-    float *zsub = malloc(sizeof(float) * size);
-	if(zsub == NULL){
-		return SOM_NO_MEMORY;
-    }
-    float *sum = malloc(sizeof(float) * size);
-	if(sum == NULL){
-		return SOM_NO_MEMORY;
-    }
-    float r;
-    size_t i;
-
-    memset(xsub, 0, size);
-    memset(ysub, 0, size);
-    memset(zsub, 0, size);
-
-    arr_sub(xsub, x, size, RGB[0]);
-    arr_sub(ysub, y, size, RGB[1]);
-    arr_sub(zsub, z, size, RGB[2]);
-
-    for(i = 0; i < size; i++){
-        sum[i] = xsub[i] + ysub[i] + zsub[i];
-        r = (float)sqrt(sum[i]);
-        memcpy(&res[i], &r, sizeof(float));
-    }
-
-    free(sum);
-    free(xsub);
-    free(ysub);
-    free(zsub);
-
-    return SOM_OK;
-}
-
 /** Compute the euclidian distance between two 2D points.
  *
  * @see https://en.wikipedia.org/wiki/Euclidean_distance
@@ -169,234 +150,797 @@ static void som_neighbourhood(float *neigh, int x, int y, float radius,
 /** Compute the new neurons values (learning stage).
  *
  * This function compute the new neurons values depending on the learning rate
- * (eta), the winner neighboors (neigh) and the choosed input vector (chan).
+ * (eta), the winner neighboors (neigh) and the choosed input vector (pick).
  * The network wieght vectors inside the neighbooring radius are modified so 
  * that they will be more similar to the choosen input vector.
  *
- * @param[out] res     The resulting array containing the delta values.
+ * @param[out] res     The resulting RGBA vectors containing the delta values.
  * @param[in]  eta     The learning rate.
  * @param[in]  neigh   Array listing the current neighbors of the network.
  * @param[in]  nbNeigh The size of the "neigh" array.
- * @param[in]  chan    The value of the color channel.
- * @param[in]  chanArr The array corresponding to the given channel.
+ * @param[in]  pick    The choosen input RGBA vector.
+ * @param[in]  weights The RGBA weight vectors of the network.
  */
-void compute_delta(float *res, float eta, float *neigh, size_t nbNeigh, 
-                   float chan, float *chanArr){
+void compute_delta(float *res, float eta, const float *neigh, size_t nbNeigh,
+                   const float *pick, const float *weights){
     size_t i;
+    int k;
 
     for(i = 0; i < nbNeigh; i++){
-        res[i] = eta * neigh[i] * (chan - chanArr[i]);
+        for(k = 0; k < PIX_CHANNELS; k++){
+            res[i * PIX_CHANNELS + k] =
+                eta * neigh[i] * (pick[k] - weights[i * PIX_CHANNELS + k]);
+        }
     }
 }
 
+/** Set the SOM training options to their default values.
+ *
+ * @param[out] opts The options to initialize.
+ */
+void som_opts_init(som_opts *opts){
+    opts->noEpoch = 3000;
+    opts->thresh = 0;
+    opts->checkEvery = 0;
+    opts->patience = 5;
+    opts->minGain = 0.01;
+    opts->seed = time(NULL);
+    opts->mem = NULL;
+    opts->deadline = 0;
+    opts->startStep = 0;
+}
+
+/** Compute the quantization error of a SOM over a set of pixels.
+ *
+ * The quantization error is the mean distance between the pixels and their
+ * Best Matching Unit. The lower the error, the closer the posterized image is
+ * from the original one.
+ *
+ * @param[in] weights   The SOM RGBA weight vectors.
+ * @param[in] nbNeurons The number of neurons of the SOM.
+ * @param[in] pixels    The image RGBA pixels.
+ * @param[in] sample    The indices of the pixels to use.
+ * @param[in] nbSample  The size of the 'sample' array.
+ *
+ * @return The quantization error.
+ */
+float som_qerror(const float *weights, int nbNeurons, const float *pixels,
+                 const unsigned int *sample, unsigned int nbSample){
+    unsigned int i;
+    const float *px;
+    double sum = 0.;
+
+    for(i = 0; i < nbSample; i++){
+        px = &pixels[sample[i] * PIX_CHANNELS];
+        sum += sqrt(vec4_dist(
+            &weights[arr_nearest(weights, nbNeurons, px) * PIX_CHANNELS], px));
+    }
+    return nbSample > 0 ? sum / nbSample : 0.;
+}
+
+/** Allocate the buffers of a SOM training.
+ *
+ * @param[out]    ws        The workspace to initialize. It must be released 
+ *  with som_workspace_free().
+ * @param[in]     nbNeurons The maximum number of neurons of the trained SOM.
+ * @param[in,out] mem       The arena to take the buffers from, or NULL for 
+ *  the heap.
+ *
+ * @return SOM_OK if everything goes right or SOM_NO_MEMORY if a memory 
+ *  allocation (malloc) fail.
+ */
+int som_workspace_init(som_workspace *ws, int nbNeurons, arena *mem){
+    ws->nbNeurons = nbNeurons;
+    ws->mem = mem;
+    ws->sample = arena_alloc(mem, sizeof(unsigned int) * SOM_QE_SAMPLES);
+    ws->neigh = arena_alloc(mem, sizeof(float) * nbNeurons);
+    ws->deltaW = arr_alloc_vec4(mem, nbNeurons);
+    ws->absDeltaW = arr_alloc_vec4(mem, nbNeurons);
+    if(ws->sample == NULL || ws->neigh == NULL || ws->deltaW == NULL || 
+       ws->absDeltaW == NULL){
+        som_workspace_free(ws);
+        return SOM_NO_MEMORY;
+    }
+    return SOM_OK;
+}
+
+/** Compute the memory som_workspace_init() takes.
+ *
+ * @param[in] nbNeurons The maximum number of neurons of the trained SOM.
+ *
+ * @return The size (in bytes) of the buffers, including their alignment.
+ */
+size_t som_workspace_memory(int nbNeurons){
+    return sizeof(unsigned int) * SOM_QE_SAMPLES + sizeof(float) * nbNeurons +
+           2 * sizeof(float) * PIX_CHANNELS * nbNeurons + 4 * ARENA_ALIGN;
+}
+
+/** Compute the memory a SOM training takes.
+ *
+ * @param[in] nbNeurons The number of neurons of the SOM.
+ * @param[in] nbRuns    The number of concurrent trainings (see 
+ *  som_train_best()).
+ *
+ * @return The size (in bytes) som_train() or som_train_best() take from their
+ *  arena, including the alignment of every buffer.
+ */
+size_t som_memory(int nbNeurons, int nbRuns){
+    if(nbRuns <= 1){
+        return som_workspace_memory(nbNeurons);
+    }
+    return (sizeof(som_run) + sizeof(pthread_t) + 
+            sizeof(float) * PIX_CHANNELS * nbNeurons + 
+            som_workspace_memory(nbNeurons) + 2 * ARENA_ALIGN) * nbRuns +
+           sizeof(unsigned int) * 4 * SOM_QE_SAMPLES + 3 * ARENA_ALIGN;
+}
+
+/** Compute the memory som_train_hogwild() takes.
+ *
+ * @param[in] nbNeurons The number of neurons of the SOM.
+ * @param[in] nbThreads The number of threads.
+ *
+ * @return The size (in bytes) som_train_hogwild() takes from its arena.
+ */
+size_t som_hogwild_memory(int nbNeurons, int nbThreads){
+    return (sizeof(som_hogwild_thread) + sizeof(pthread_t) + 
+            sizeof(float) * nbNeurons + 3 * ARENA_ALIGN) * nbThreads +
+           sizeof(unsigned int) * SOM_QE_SAMPLES + ARENA_ALIGN;
+}
+
+/** Release the buffers of a SOM training.
+ *
+ * @param[in,out] ws The workspace initialized by som_workspace_init().
+ */
+void som_workspace_free(som_workspace *ws){
+    arena_free(ws->mem, ws->sample);
+    arena_free(ws->mem, ws->neigh);
+    arena_free(ws->mem, ws->deltaW);
+    arena_free(ws->mem, ws->absDeltaW);
+    memset(ws, 0, sizeof(som_workspace));
+}
+
+/** Compute the training progress at an iteration.
+ *
+ * @param[in] s  The schedules.
+ * @param[in] it The iteration number.
+ *
+ * @return The progress, from 's->step' to 1 (end of the schedules).
+ */
+static float som_schedule_step(const som_schedule *s, int it){
+    if(it >= s->start + s->length){
+        return 1;
+    }
+    return s->step + (1 - s->step) * (it - s->start) / (float)s->length;
+}
+
+/** Compress the rest of the schedules into fewer iterations.
+ *
+ * @param[in,out] s      The schedules.
+ * @param[in]     it     The current iteration number.
+ * @param[in]     length The iterations left to reach the end (at least 1).
+ */
+static void som_schedule_shorten(som_schedule *s, int it, int length){
+    s->step = som_schedule_step(s, it);
+    s->start = it;
+    s->length = max(length, 1);
+}
+
+/** Fit the rest of the schedules before a deadline.
+ *
+ * The iteration rate measured since 'start' tells how many more iterations
+ * fit before the deadline. When they are fewer than what is left of the 
+ * schedules, the schedules are compressed into them.
+ *
+ * @param[in,out] s        The schedules.
+ * @param[in]     it       The number of iterations done since 'start'.
+ * @param[in]     start    The now_ms() time the training started.
+ * @param[in]     deadline The now_ms() time to be done by.
+ *
+ * @return 1 if the deadline is passed, 0 otherwise.
+ */
+static int som_schedule_deadline(som_schedule *s, int it, double start,
+                                 double deadline){
+    double elapsed = now_ms() - start;  // Time spent training so far
+    int left;                           // Iterations left before deadline
+
+    if(start + elapsed >= deadline){
+        return 1;
+    }
+    left = (int)min((deadline - start - elapsed) * it / max(elapsed, 1e-3), 
+                    (double)INT_MAX);
+    if(left < s->start + s->length - it){
+        som_schedule_shorten(s, it, left);
+    }
+    return 0;
+}
+
 /** Train the unsupervised SOM network.
  *
  * The network is initialized with random (non-graduate) values. It is then
- * trained with the image pixels (RGB). Once the network is done training the
+ * trained with the image pixels (RGBA). Once the network is done training the
  * centroids of the resulting clusters is returned.
  *
+ * The training stops after 'opts->noEpoch' iterations or as soon as it has
+ * converged. Two convergence criteria are monitored:
+ *  - the moving average of the weight change (a single iteration change is
+ *    far too noisy) falls under 'opts->thresh'. The change of an iteration
+ *    is the sum of the absolute changes of the channels over the neurons,
+ *    divided by the number of neurons, so the threshold does not depend on 
+ *    the size of the map. As the learning rate never falls under 0.1, the
+ *    map is usually not annealed yet when it fires: it trades quality for
+ *    time and is disabled by default (0);
+ *  - the quantization error plateaus. The distance between each picked pixel
+ *    and its BMU, measured before the update, is the error of a pixel the
+ *    map was not trained on yet, so averaging it over a window of 
+ *    'opts->patience' checks of 'opts->checkEvery' iterations gives the
+ *    error for free. Once SOM_PLATEAU_FROM of the schedules are done, the
+ *    mean error of a window is compared to the one of the previous window:
+ *    if it did not improve by 'opts->minGain' per check, even allowing for
+ *    two standard errors of sampling noise, the map is at equilibrium for
+ *    its radius and more iterations at that radius are wasted. The rest of 
+ *    the radius and learning rate schedules is then shortened by 
+ *    SOM_PLATEAU_SHRINK (but not under one window), so that the map still
+ *    ends up annealed. The test does not depend on the radius and can fire
+ *    again at the next window.
+ *
+ * If 'opts->deadline' is set, the training is also an anytime algorithm. The
+ * clock is read every SOM_CLOCK_EVERY iterations and the iteration rate 
+ * measured so far tells how many more iterations fit before the deadline. 
+ * When they are fewer than what is left of the schedules, the schedules are
+ * compressed the same way so that the map is still annealed by the deadline.
+ * The training stops in any case once the deadline is passed.
+ *
+ * If 'opts->startStep' is set, the weights are not initialized: the given
+ * ones are fine tuned by the end of the schedules only (from that progress
+ * to 1), so a palette can be adjusted to new pixels in a few iterations.
+ *
  * @note The length of the clusters depends on the parameter 'n'. The greatest
  *  n, the more colors in the clusters, the less posterized the image.
  *
- * @param[out] res       The resulting R, G and B clusters centroids.
- * @param[in]  imgPixels The original image pixels.
+ * @param[out] weights   The resulting RGBA clusters centroids. It must be an
+ *  array of 'nbNeurons' vectors (see arr_alloc_vec4()). It holds the weights
+ *  to fine tune if 'opts->startStep' is set.
+ * @param[in]  imgPixels The original image RGBA pixels (see arr_from_IplImage).
  * @param[in]  nbPixels  The number of pixels of th image (height * width).
  * @param[in]  nbNeurons The posterization leveldefined by its number of 
  *                       neurons.
- * @param[in]  noEpoch   Number of training passes (a too small number of epochs
- *  won't be enough for the network to correctly know the image but a too high
- *  value will force the network to modify the wieghts so much that the image
- *  can actually looks "ugly").
- * @param[in]  thresh    The threshold value. The SOM delta parameter and the
- *  training rate are dicreasing from one epoch to the next. The treshold value
- *  set a stop condifition in case the value has fallen under this minimum 
- *  value.
+ * @param[in]  opts      The training options (see som_opts_init()).
+ * @param[in]  ws        The training buffers (see som_workspace_init()). If
+ *  NULL, they are allocated for this training only.
+ * @param[out] stats     The number of iterations done and the final 
+ *  quantization error. Can be NULL.
  *
  * @return SOM_OK if everything goes right or SOM_NO_MEMORY if a memory 
  *  allocation (malloc) fail.
  */
-int som_train(float **res, float **imgPixels, unsigned int nbPixels,
-              int nbNeurons, int noEpoch, float thresh){
+int som_train(float *weights, const float *imgPixels, unsigned int nbPixels,
+              int nbNeurons, const som_opts *opts, som_workspace *ws, 
+              som_stats *stats){
     int mapWidth =              // Map width. This can be calculated from its
         (int)sqrt(nbNeurons);   // number of neurons as the map is square.
     int mapHeight =             // Map height. This can be calculated from its
         (int)sqrt(nbNeurons);   // number of neurons as the map is square.
-    float delta = INT_MAX;      // Start with an almost impossible value
+    int noEpoch = opts->noEpoch;
+    int checkEvery =            // Iterations between two error checks
+        opts->checkEvery > 0 ? opts->checkEvery : max(noEpoch / 100, 50);
+    float step =                // Training progress (from 0 to 1)
+        opts->startStep;
+    som_schedule sched =        // Radius and learning rate schedules
+        {step, 0, max(noEpoch, 1)};
+    double start = now_ms();    // When the training started
+    int left;                   // Iterations left in the schedules
+    float delta;                // Weight change of the current iteration
+    float avgDelta = -1;        // Moving average of the weight change
+    double windowQerror = 0;    // Sum of the BMU distances of the window
+    double windowSquares = 0;   // Sum of their squares
+    double lastSquares = 0;     // Variance of the previous window mean
+    double dist;                // Distance between the pick and its BMU
+    int windowLength = 0;       // Number of iterations of the window
+    double lastQerror = -1;     // Mean BMU distance of the previous window
+    int nbChecks = 0;           // Number of checks in the current window
     int it = 0;                 // Count the network iterations
-    unsigned int pick;          // The choosen input pixel
+    int i;                      // Iterator indice
+    const float *pick;          // The choosen input RGBA vector
     float rad;                  // Neighbooring radius (keep dicreasing)
     float eta;                  // Learning rate (keep dicreasing)
-    float pickRGB[3] = {0};     // Contains the choosen input RGB vector
     size_t choosen;             // Best Matching Unit (BMU)
     int choosen_x;              // BMU abscissa
     int choosen_y;              // BMU ordinate
-    float *neigh =              // Neighbooring mask
-        malloc(sizeof(float) * nbNeurons);
-	if(neigh == NULL){
-		return SOM_NO_MEMORY;
-    }
-    memset(neigh, 0, nbNeurons);
-
-    float *WR =                 // RED part of the network weight vectors
-        malloc(sizeof(float) * nbNeurons);
-	if(WR == NULL){
-		return SOM_NO_MEMORY;
-    }
-    memset(WR, 0, nbNeurons);
-    float *WG =                 // GREEN part of the network weight vectors
-        malloc(sizeof(float) * nbNeurons);
-	if(WG == NULL){
-		return SOM_NO_MEMORY;
-    }
-    memset(WG, 0, nbNeurons);
-    float *WB =                 // BLUE part of the network weight vectors
-        malloc(sizeof(float) * nbNeurons);
-	if(WB == NULL){
-		return SOM_NO_MEMORY;
-    }
-    memset(WB, 0, nbNeurons);
-
-    float *deltaR =             // New RED part of the network weight vectors
-        malloc(sizeof(float) * nbNeurons);
-	if(deltaR == NULL){
-		return SOM_NO_MEMORY;
-    }
-    memset(deltaR, 0, nbNeurons);
-    float *deltaG =             // New GREEN part of the network weight vectors
-        malloc(sizeof(float) * nbNeurons);
-	if(deltaG == NULL){
-		return SOM_NO_MEMORY;
-    }
-    memset(deltaG, 0, nbNeurons);
-    float *deltaB =             // New BLUE part of the network weight vectors
-        malloc(sizeof(float) * nbNeurons);
-	if(deltaB == NULL){
-		return SOM_NO_MEMORY;
-    }
-    memset(deltaB, 0, nbNeurons);
-
-    float *absDeltaR =          // Absolute value of deltaR
-        malloc(sizeof(float) * nbNeurons);
-	if(absDeltaR == NULL){
-		return SOM_NO_MEMORY;
-    }
-    memset(absDeltaR, 0, nbNeurons);
-    float *absDeltaG =          // Absolute value of deltaG
-        malloc(sizeof(float) * nbNeurons);
-	if(absDeltaG == NULL){
-		return SOM_NO_MEMORY;
-    }
-    memset(absDeltaG, 0, nbNeurons);
-    float *absDeltaB =          // Absolute value of deltaB
-        malloc(sizeof(float) * nbNeurons);
-	if(absDeltaB == NULL){
-		return SOM_NO_MEMORY;
-    }
-    memset(absDeltaB, 0, nbNeurons);
-
-    float *dists =              // Vectors euclidian distances from input form
-        malloc(sizeof(float) * nbNeurons);
-	if(dists == NULL){
-		return SOM_NO_MEMORY;
-    }
-    memset(dists, 0, nbNeurons);
-
-    /* Randomly initialize weight vectors */
-    srand(time(NULL));
-    random_sample(WR, nbNeurons);
-    random_sample(WG, nbNeurons);
-    random_sample(WB, nbNeurons);
-
-    while(it < noEpoch && delta >= thresh){
+    unsigned int seed =         // State of the random number generator
+        opts->seed;
+    unsigned int nbSample =     // Number of pixels used to measure the error
+        nbPixels < SOM_QE_SAMPLES ? nbPixels : SOM_QE_SAMPLES;
+    som_workspace localWs;      // Buffers if the caller did not give any
+    unsigned int *sample;       // Pixels used to measure the error
+    float *neigh;               // Neighbooring mask
+    float *deltaW;              // New RGBA part of the network weight vectors
+    float *absDeltaW;           // Absolute value of deltaW
+
+    if(ws == NULL || ws->nbNeurons < nbNeurons){
+        if(som_workspace_init(&localWs, nbNeurons, opts->mem) != SOM_OK){
+            return SOM_NO_MEMORY;
+        }
+    }
+    else{
+        localWs = *ws;
+        localWs.nbNeurons = 0;  // Not owned: do not free it at the end
+    }
+    sample = localWs.sample;
+    neigh = localWs.neigh;
+    deltaW = localWs.deltaW;
+    absDeltaW = localWs.absDeltaW;
+
+    /* Randomly initialize weight vectors (opaque colors) */
+    if(opts->startStep <= 0){
+        random_sample(weights, nbNeurons * PIX_CHANNELS, &seed);
+        for(i = 0; i < nbNeurons; i++){
+            weights[i * PIX_CHANNELS + 3] = 1.;
+        }
+    }
+    for(i = 0; i < nbSample; i++){
+        sample[i] = random_uint(nbPixels, &seed);
+    }
+
+    while(step < 1){
         /* Randomly choose an input form */
-        pick = random_uint(nbPixels);
-        pickRGB[0] = imgPixels[pick][0];
-        pickRGB[1] = imgPixels[pick][1];
-        pickRGB[2] = imgPixels[pick][2];
-
-        /* Compute every vectors euclidian distance from the input form */
-        euclidian(dists, nbNeurons, WR, WG, WB, pickRGB);
-        /* Determine the BMU */
-        choosen = arr_min_idx(dists, nbNeurons);
+        pick = &imgPixels[random_uint(nbPixels, &seed) * PIX_CHANNELS];
+
+        /* Determine the BMU (closest vector from the input form) */
+        choosen = arr_nearest(weights, nbNeurons, pick);
+        /* Its distance is the error of a pixel not trained on yet */
+        dist = sqrt(vec4_dist(&weights[choosen * PIX_CHANNELS], pick));
+        windowQerror += dist;
+        windowSquares += dist * dist;
+        windowLength++;
         choosen_x = (int)choosen % mapWidth;
         choosen_y = choosen / mapHeight;
 
         /* Compute the new neighbooring radius */
-        rad = som_radius(it, noEpoch, mapWidth, mapHeight);
+        rad = som_radius(step, mapWidth, mapHeight);
         /* Find the BMU neighboors */
         som_neighbourhood(neigh, choosen_x, choosen_y, rad, mapWidth, 
                           mapHeight);
 
         /* Compute the new learning rate */
-        eta = som_learning_rate(it, noEpoch);
+        eta = som_learning_rate(step);
         /* Compute new value of the network weight vectors */
-        compute_delta(deltaR, eta, neigh, nbNeurons, pickRGB[0], WR);
-        compute_delta(deltaG, eta, neigh, nbNeurons, pickRGB[1], WG);
-        compute_delta(deltaB, eta, neigh, nbNeurons, pickRGB[2], WB);
+        compute_delta(deltaW, eta, neigh, nbNeurons, pick, weights);
         /* Update the network weight vectors values */
-        arr_add(WR, deltaR, nbNeurons);
-        arr_add(WG, deltaG, nbNeurons);
-        arr_add(WB, deltaB, nbNeurons);
+        arr_add(weights, deltaW, nbNeurons * PIX_CHANNELS);
 
-        arr_abs(absDeltaR, deltaR, nbNeurons);
-        arr_abs(absDeltaG, deltaG, nbNeurons);
-        arr_abs(absDeltaB, deltaB, nbNeurons);
-        delta = arr_sum(absDeltaR, nbNeurons) +
-                arr_sum(absDeltaG, nbNeurons) +
-                arr_sum(absDeltaB, nbNeurons);
+        arr_abs(absDeltaW, deltaW, nbNeurons * PIX_CHANNELS);
+        delta = arr_sum(absDeltaW, nbNeurons * PIX_CHANNELS) / nbNeurons;
+        avgDelta = avgDelta < 0 ? delta :
+                   avgDelta + (delta - avgDelta) / checkEvery;
 
         it++;
+        step = som_schedule_step(&sched, it);
+
+        /* Check the convergence */
+        if(it >= checkEvery && avgDelta < opts->thresh){
+            break;
+        }
+        if(opts->patience > 0 && it % checkEvery == 0 && 
+           ++nbChecks >= opts->patience){
+            /* Plateau (the mean gain per check between the two last windows
+             * is low, even allowing for the sampling noise): speed up the 
+             * rest of the schedules */
+            windowQerror /= windowLength;
+            windowSquares = (windowSquares / windowLength - 
+                             windowQerror * windowQerror) / windowLength;
+            if(step >= SOM_PLATEAU_FROM && lastQerror > 0 &&
+               (lastQerror - windowQerror + 
+                2 * sqrt(windowSquares + lastSquares)) / 
+               (lastQerror * nbChecks) < opts->minGain){
+                left = sched.start + sched.length - it;
+                som_schedule_shorten(&sched, it, 
+                                     max((int)(left * SOM_PLATEAU_SHRINK), 
+                                         min(checkEvery * opts->patience, 
+                                             left)));
+            }
+            lastQerror = windowQerror;
+            lastSquares = windowSquares;
+            windowQerror = 0;
+            windowSquares = 0;
+            windowLength = 0;
+            nbChecks = 0;
+        }
+
+        /* Check the time left */
+        if(opts->deadline > 0 && it % SOM_CLOCK_EVERY == 0 &&
+           som_schedule_deadline(&sched, it, start, opts->deadline)){
+            break;
+        }
+    }
+
+    if(stats != NULL){
+        stats->epochs = it;
+        stats->qerror = som_qerror(weights, nbNeurons, imgPixels, sample, 
+                                   nbSample);
     }
-    res[0] = WR;
-    res[1] = WG;
-    res[2] = WB;
 
-    free(dists);
-    free(deltaR);
-    free(deltaG);
-    free(deltaB);
-    free(absDeltaR);
-    free(absDeltaG);
-    free(absDeltaB);
-    free(neigh);
+    if(localWs.nbNeurons > 0){
+        som_workspace_free(&localWs);
+    }
 
     return SOM_OK;
 }
 
+/** Thread routine running one of the trainings of som_train_best().
+ *
+ * @param[in,out] arg The som_run describing the training.
+ *
+ * @return NULL.
+ */
+static void *som_run_thread(void *arg){
+    som_run *run = arg;
+
+    run->res = som_train(run->weights, run->imgPixels, run->nbPixels, 
+                         run->nbNeurons, &run->opts, NULL, &run->stats);
+    if(run->res == SOM_OK){
+        run->score = som_qerror(run->weights, run->nbNeurons, run->imgPixels,
+                                run->sample, run->nbSample);
+    }
+    return NULL;
+}
+
+/** Train several SOM concurrently and keep the best one.
+ *
+ * Because the weights are randomly initialized, the quality of a SOM varies
+ * from one training to the other. This function trains 'nbRuns' SOM at the
+ * same time, each in its own thread with its own seed and buffers. They are
+ * scored by their quantization error over the same sample of pixels and the
+ * best one is returned. On a multi-core machine it costs about the same time
+ * as a single training.
+ *
+ * @param[out] weights   The best SOM RGBA weight vectors (see som_train()).
+ * @param[in]  imgPixels The original image RGBA pixels.
+ * @param[in]  nbPixels  The number of pixels of th image (height * width).
+ * @param[in]  nbNeurons The number of neurons of the SOM.
+ * @param[in]  opts      The training options. The seed of the i-th training is
+ *  derived from 'opts->seed'.
+ * @param[in]  nbRuns    The number of trainings.
+ * @param[out] stats     The statistics of the best training. Can be NULL.
+ *
+ * @return SOM_OK if everything goes right or SOM_NO_MEMORY if a memory 
+ *  allocation (malloc) or a thread creation fail.
+ */
+int som_train_best(float *weights, const float *imgPixels, 
+                   unsigned int nbPixels, int nbNeurons, const som_opts *opts,
+                   int nbRuns, som_stats *stats){
+    som_run *runs;
+    pthread_t *threads;
+    unsigned int *sample;
+    unsigned int nbSample =
+        nbPixels < 4 * SOM_QE_SAMPLES ? nbPixels : 4 * SOM_QE_SAMPLES;
+    unsigned int seed = opts->seed;
+    int started = 0;
+    int best = -1;
+    int res = SOM_OK;
+    int i;
+
+    if(nbRuns <= 1){
+        return som_train(weights, imgPixels, nbPixels, nbNeurons, opts, NULL,
+                         stats);
+    }
+
+    runs = arena_alloc(opts->mem, sizeof(som_run) * nbRuns);
+    threads = arena_alloc(opts->mem, sizeof(pthread_t) * nbRuns);
+    sample = arena_alloc(opts->mem, sizeof(unsigned int) * nbSample);
+    if(runs == NULL || threads == NULL || sample == NULL){
+        arena_free(opts->mem, runs);
+        arena_free(opts->mem, threads);
+        arena_free(opts->mem, sample);
+        return SOM_NO_MEMORY;
+    }
+    for(i = 0; i < nbSample; i++){
+        sample[i] = random_uint(nbPixels, &seed);
+    }
+
+    for(i = 0; i < nbRuns; i++){
+        runs[i].weights = arr_alloc_vec4(opts->mem, nbNeurons);
+        if(runs[i].weights == NULL){
+            res = SOM_NO_MEMORY;
+        }
+        runs[i].imgPixels = imgPixels;
+        runs[i].nbPixels = nbPixels;
+        runs[i].nbNeurons = nbNeurons;
+        runs[i].opts = *opts;
+        runs[i].opts.seed = opts->seed + 7919 * (i + 1);
+        runs[i].sample = sample;
+        runs[i].nbSample = nbSample;
+    }
+    for(started = 0; res == SOM_OK && started < nbRuns; started++){
+        if(pthread_create(&threads[started], NULL, som_run_thread, 
+                          &runs[started]) != 0){
+            res = SOM_NO_MEMORY;
+            break;
+        }
+    }
+    for(i = 0; i < started; i++){
+        pthread_join(threads[i], NULL);
+        if(runs[i].res != SOM_OK){
+            res = runs[i].res;
+        }
+        else if(best < 0 || runs[i].score < runs[best].score){
+            best = i;
+        }
+    }
+    if(res == SOM_OK){
+        memcpy(weights, runs[best].weights, 
+               sizeof(float) * PIX_CHANNELS * nbNeurons);
+        if(stats != NULL){
+            *stats = runs[best].stats;
+        }
+    }
+
+    for(i = 0; i < nbRuns; i++){
+        arena_free(opts->mem, runs[i].weights);
+    }
+    arena_free(opts->mem, runs);
+    arena_free(opts->mem, threads);
+    arena_free(opts->mem, sample);
+    return res;
+}
+
+/** Run the online training of som_train_hogwild() (thread entry point).
+ *
+ * The iteration number comes from the shared counter, so the radius and 
+ * learning rate schedules follow the total progress of all the threads. The
+ * update is the one of compute_delta() but it is applied in place, neuron by
+ * neuron and only inside the neighbouring radius. Each weight is updated with
+ * a relaxed atomic compare and swap, so no update of another thread is lost;
+ * the BMU may just be searched in weights which change meanwhile. A thread
+ * preempted in the middle of an update (more threads than processors) would
+ * apply it much later with a radius and learning rate of the past, so the
+ * rest of an update is dropped once the other threads went SOM_HOGWILD_LAG 
+ * of the schedules further.
+ *
+ * The thread drawing an iteration multiple of SOM_CLOCK_EVERY fits the 
+ * shared schedules before the deadline as som_train() does. The other threads
+ * keep a copy of the schedules and only lock them when they changed.
+ *
+ * @param[in,out] arg The thread (som_hogwild_thread).
+ *
+ * @return NULL.
+ */
+static void *som_hogwild_run(void *arg){
+    som_hogwild_thread *t = arg;
+    som_hogwild *sh = t->shared;
+    int mapWidth = (int)sqrt(sh->nbNeurons);
+    int maxLag =                // Iterations after which an update is dropped
+        max((int)(sh->opts->noEpoch * SOM_HOGWILD_LAG), 1);
+    int now;                    // Iterations started by all the threads
+    int end;                    // Iteration at which the schedules end
+    int passed;                 // Whether the deadline is passed
+    const float *pick;
+    float *w;
+    float step, rad, eta;
+    float old, val;             // A weight before and after the update
+    size_t choosen;
+    int it, i, k;
+
+    for(;;){
+        it = __atomic_fetch_add(&sh->it, 1, __ATOMIC_RELAXED);
+        if(__atomic_load_n(&sh->version, __ATOMIC_ACQUIRE) != t->version){
+            pthread_mutex_lock(&sh->lock);
+            t->sched = sh->sched;
+            t->version = sh->version;
+            pthread_mutex_unlock(&sh->lock);
+        }
+        if(som_schedule_step(&t->sched, it) >= 1){
+            break;
+        }
+        if(it == 0){
+            /* Do not count the thread creations in the iteration rate */
+            pthread_mutex_lock(&sh->lock);
+            sh->start = now_ms();
+            pthread_mutex_unlock(&sh->lock);
+        }
+
+        /* Check the time left */
+        if(sh->opts->deadline > 0 && it > 0 && it % SOM_CLOCK_EVERY == 0){
+            pthread_mutex_lock(&sh->lock);
+            end = sh->sched.start + sh->sched.length;
+            passed = 0;
+            if(it >= sh->sched.start){ // Else a later check was done already
+                passed = som_schedule_deadline(&sh->sched, it, sh->start, 
+                                               sh->opts->deadline);
+            }
+            if(passed){
+                sh->sched.length = it - sh->sched.start;  // End them here
+            }
+            if(sh->sched.start + sh->sched.length != end){
+                __atomic_store_n(&sh->version, sh->version + 1, 
+                                 __ATOMIC_RELEASE);
+            }
+            pthread_mutex_unlock(&sh->lock);
+            if(passed){
+                break;
+            }
+        }
+
+        pick = &sh->imgPixels[random_uint(sh->nbPixels, &t->seed) * 
+                              PIX_CHANNELS];
+        choosen = arr_nearest(sh->weights, sh->nbNeurons, pick);
+
+        /* Progress of all the threads, read as late as possible */
+        now = __atomic_load_n(&sh->it, __ATOMIC_RELAXED);
+        end = t->sched.start + t->sched.length;
+        step = som_schedule_step(&t->sched, max(it, min(now, end) - 1));
+        rad = som_radius(step, mapWidth, mapWidth);
+        som_neighbourhood(t->neigh, (int)choosen % mapWidth, 
+                          choosen / mapWidth, rad, mapWidth, mapWidth);
+        eta = som_learning_rate(step);
+        for(i = 0; i < sh->nbNeurons; i++){
+            if(i % mapWidth == 0 && 
+               __atomic_load_n(&sh->it, __ATOMIC_RELAXED) - now > maxLag){
+                break;  // Preempted for too long: the update is outdated
+            }
+            if(t->neigh[i] <= 0){
+                continue;
+            }
+            w = &sh->weights[i * PIX_CHANNELS];
+            for(k = 0; k < PIX_CHANNELS; k++){
+                __atomic_load(&w[k], &old, __ATOMIC_RELAXED);
+                do{
+                    val = old + eta * t->neigh[i] * (pick[k] - old);
+                }while(!__atomic_compare_exchange(&w[k], &old, &val, 1, 
+                                                  __ATOMIC_RELAXED, 
+                                                  __ATOMIC_RELAXED));
+            }
+        }
+    }
+    return NULL;
+}
+
+/** Train a SOM with several threads sharing its weights (Hogwild).
+ *
+ * Unlike som_train_best(), the threads do not train separate SOM: they all
+ * run the online training of som_train() on the same weights, without any
+ * lock (see som_hogwild_run()). The network is initialized as in som_train()
+ * and 'opts->noEpoch' iterations are done in total, so the learning dynamics
+ * are those of a serial training while the iterations are spread over the 
+ * threads. The convergence criteria of som_train() are not used, but the
+ * schedules are fitted before the deadline ('opts->deadline') the same way,
+ * so the map is still annealed when the time is short.
+ *
+ * @note The BMU search reads the weights while other threads update them. 
+ *  The weights are aligned floats so a read never sees a torn value, only a
+ *  slightly outdated one.
+ *
+ * @param[out] weights   The resulting RGBA weight vectors (see som_train()).
+ * @param[in]  imgPixels The original image RGBA pixels.
+ * @param[in]  nbPixels  The number of pixels of th image (height * width).
+ * @param[in]  nbNeurons The number of neurons of the SOM.
+ * @param[in]  opts      The training options (see som_opts_init()).
+ * @param[in]  nbThreads The number of threads.
+ * @param[out] stats     The number of iterations done and the final 
+ *  quantization error. Can be NULL.
+ *
+ * @return SOM_OK if everything goes right or SOM_NO_MEMORY if a memory 
+ *  allocation (malloc) fail.
+ */
+int som_train_hogwild(float *weights, const float *imgPixels, 
+                      unsigned int nbPixels, int nbNeurons, 
+                      const som_opts *opts, int nbThreads, som_stats *stats){
+    som_hogwild shared;
+    som_hogwild_thread *threads;
+    pthread_t *ids;
+    unsigned int *sample;
+    unsigned int seed = opts->seed;
+    unsigned int nbSample =     // Number of pixels used to measure the error
+        nbPixels < SOM_QE_SAMPLES ? nbPixels : SOM_QE_SAMPLES;
+    int started = 0;
+    int res = SOM_OK;
+    int i;
+
+    if(nbThreads <= 1){
+        return som_train(weights, imgPixels, nbPixels, nbNeurons, opts, NULL,
+                         stats);
+    }
+
+    threads = arena_alloc(opts->mem, sizeof(som_hogwild_thread) * nbThreads);
+    ids = arena_alloc(opts->mem, sizeof(pthread_t) * nbThreads);
+    sample = arena_alloc(opts->mem, sizeof(unsigned int) * SOM_QE_SAMPLES);
+    if(threads == NULL || ids == NULL || sample == NULL){
+        arena_free(opts->mem, threads);
+        arena_free(opts->mem, ids);
+        arena_free(opts->mem, sample);
+        return SOM_NO_MEMORY;
+    }
+
+    /* Randomly initialize weight vectors (opaque colors) */
+    random_sample(weights, nbNeurons * PIX_CHANNELS, &seed);
+    for(i = 0; i < nbNeurons; i++){
+        weights[i * PIX_CHANNELS + 3] = 1.;
+    }
+
+    shared.weights = weights;
+    shared.imgPixels = imgPixels;
+    shared.nbPixels = nbPixels;
+    shared.nbNeurons = nbNeurons;
+    shared.opts = opts;
+    shared.it = 0;
+    shared.start = now_ms();
+    shared.sched.step = 0;
+    shared.sched.start = 0;
+    shared.sched.length = max(opts->noEpoch, 1);
+    shared.version = 0;
+    pthread_mutex_init(&shared.lock, NULL);
+    for(i = 0; i < nbThreads; i++){
+        threads[i].shared = &shared;
+        threads[i].seed = opts->seed + 7919 * (i + 1);
+        threads[i].sched = shared.sched;
+        threads[i].version = 0;
+        threads[i].neigh = arena_alloc(opts->mem, sizeof(float) * nbNeurons);
+        if(threads[i].neigh == NULL){
+            res = SOM_NO_MEMORY;
+        }
+    }
+    for(started = 0; res == SOM_OK && started < nbThreads; started++){
+        if(pthread_create(&ids[started], NULL, som_hogwild_run, 
+                          &threads[started]) != 0){
+            break;
+        }
+    }
+    if(res == SOM_OK && started == 0){
+        som_hogwild_run(&threads[0]);   // No thread: train serially
+    }
+    for(i = 0; i < started; i++){
+        pthread_join(ids[i], NULL);
+    }
+
+    if(res == SOM_OK && stats != NULL){
+        for(i = 0; i < nbSample; i++){
+            sample[i] = random_uint(nbPixels, &seed);
+        }
+        stats->epochs = min(shared.it, 
+                            shared.sched.start + shared.sched.length);
+        stats->qerror = som_qerror(weights, nbNeurons, imgPixels, sample, 
+                                   nbSample);
+    }
+
+    pthread_mutex_destroy(&shared.lock);
+    for(i = 0; i < nbThreads; i++){
+        arena_free(opts->mem, threads[i].neigh);
+    }
+    arena_free(opts->mem, threads);
+    arena_free(opts->mem, ids);
+    arena_free(opts->mem, sample);
+    return res;
+}
+
 /** Posterize an image from the trained SOM otput.
  *
- * This function fill a vector containing the RGB values of each pixels of an
- * image with the output of a trained SOM. The original image pixels RGB values
+ * This function fill a vector containing the RGBA values of each pixels of an
+ * image with the output of a trained SOM. The original image pixels RGBA values
  * are needed to compute the euclidian distance from its colors to the trained
  * SIOM output colors.
  * Basicaly you can see this function job as a smart color selector. For each
  * pixel of the original image the function compute the "nearest" color among
  * the reduced set of olors of the SOM output.
  *
- * @param[out] postPixels The 2D array wich will contains the posterized pixels.
+ * @note 'postPixels' and 'origPixels' can be the same array.
+ *
+ * @param[out] postPixels The RGBA vectors wich will contains the posterized 
+ *                        pixels.
  * @param[in]  origPixels The original image pixels.
- * @param[in]  train      The trained SOM output vector (its map).
+ * @param[in]  weights    The trained SOM output vectors (its map).
  * @param[in]  nbPixels   The number of pixels of th image (height * width).
  * @param[in]  nbNeurons  The posterization level defined by its number of 
  *                        neurons.
  */
-void som_posterize(float **postPixels, float **origPixels, float *train[],
-                   unsigned int nbPixels, int nbNeurons){
+void som_posterize(float *postPixels, const float *origPixels,
+                   const float *weights, unsigned int nbPixels, int nbNeurons){
     unsigned int i;
-    float dists[nbNeurons];
-    float choosen, o0, o1, o2;
+    size_t choosen;
 
     for(i = 0; i < nbPixels; i++){
-        euclidian(dists, nbNeurons, train[0], train[1], train[2], 
-                  origPixels[i]);
-        choosen = arr_min_idx(dists, nbNeurons);
-
-        o0 = train[0][(int)choosen];
-        o1 = train[1][(int)choosen];
-        o2 = train[2][(int)choosen];
-
-        postPixels[i][0] = (int)(o0 * 255.);
-        postPixels[i][1] = (int)(o1 * 255.);
-        postPixels[i][2] = (int)(o2 * 255.);
+        choosen = arr_nearest(weights, nbNeurons, 
+                              &origPixels[i * PIX_CHANNELS]);
+        memcpy(&postPixels[i * PIX_CHANNELS], 
+               &weights[choosen * PIX_CHANNELS], 
+               sizeof(float) * PIX_CHANNELS);
     }
 }
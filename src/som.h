@@ -3,16 +3,70 @@
 
 /*====| INCLUDES |============================================================*/
 #include <stdlib.h>
+#include "arena.h"
 
 /*====| DEFINES |=============================================================*/
 #define SOM_NO_MEMORY 10
 #define SOM_OK 0
+#define SOM_QE_SAMPLES 512  // Pixels used to measure the quantization error
+#define SOM_CLOCK_EVERY 32  // Iterations between two reads of the clock
+#define SOM_PLATEAU_FROM 0.25   // Schedule progress before plateaus count
+#define SOM_PLATEAU_SHRINK 0.5  // Part of the schedules kept at a plateau
+#define SOM_HOGWILD_LAG 0.01 // Progress making a pending Hogwild update stale
+
+/*====| TYPES |===============================================================*/
+/** The SOM training options (see som_opts_init() for the default values). */
+typedef struct{
+    int noEpoch;        // Maximum number of training iterations
+    float thresh;       // Stop when the mean weight change of a neuron fall
+                        // under it (0: no threshold)
+    int checkEvery;     // Iterations between two quantization error checks
+    int patience;       // Checks per error window (0: no plateau detection)
+    float minGain;      // Minimum relative error gain per check
+    unsigned int seed;  // Seed of the random number generator
+    arena *mem;         // Memory of the training buffers (NULL: the heap)
+    double deadline;    // now_ms() time to end the training by (0: none)
+    float startStep;    // Progress to start from with the given weights (0: 
+                        // random weights, full schedules)
+} som_opts;
+
+/** What happened during a SOM training. */
+typedef struct{
+    int epochs;         // Number of iterations actually done
+    float qerror;       // Quantization error at the end of the training
+} som_stats;
+
+/** The buffers of a SOM training. A workspace can be reused by any number of
+ * trainings of SOM with at most 'nbNeurons' neurons, one thread at a time. */
+typedef struct{
+    int nbNeurons;          // Maximum number of neurons
+    arena *mem;             // Memory the buffers are taken from
+    unsigned int *sample;   // Pixels used to measure the quantization error
+    float *neigh;           // Neighbooring mask
+    float *deltaW;          // New RGBA part of the network weight vectors
+    float *absDeltaW;       // Absolute value of deltaW
+} som_workspace;
 
 /*====| PROTOTYPES |==========================================================*/
-void compute_delta(float *res, float eta, float *neigh, size_t nbNeigh, 
-                   float chan, float *chanArr);
-int som_train(float **res, float **imgPixels, unsigned int nbPixels,
-              int nbNeurons, int noEpoch, float tresh);
-void som_posterize(float **postPixels, float **origPixels, float *train[],
-                   unsigned int nbPixels, int nbNeurons);
+void compute_delta(float *res, float eta, const float *neigh, size_t nbNeigh,
+                   const float *pick, const float *weights);
+void som_opts_init(som_opts *opts);
+float som_qerror(const float *weights, int nbNeurons, const float *pixels,
+                 const unsigned int *sample, unsigned int nbSample);
+size_t som_workspace_memory(int nbNeurons);
+size_t som_memory(int nbNeurons, int nbRuns);
+size_t som_hogwild_memory(int nbNeurons, int nbThreads);
+int som_workspace_init(som_workspace *ws, int nbNeurons, arena *mem);
+void som_workspace_free(som_workspace *ws);
+int som_train(float *weights, const float *imgPixels, unsigned int nbPixels,
+              int nbNeurons, const som_opts *opts, som_workspace *ws, 
+              som_stats *stats);
+int som_train_best(float *weights, const float *imgPixels, 
+                   unsigned int nbPixels, int nbNeurons, const som_opts *opts,
+                   int nbRuns, som_stats *stats);
+int som_train_hogwild(float *weights, const float *imgPixels, 
+                      unsigned int nbPixels, int nbNeurons, 
+                      const som_opts *opts, int nbThreads, som_stats *stats);
+void som_posterize(float *postPixels, const float *origPixels,
+                   const float *weights, unsigned int nbPixels, int nbNeurons);
 #endif
@@ -7,35 +7,39 @@
 
 /*====| INCLUDES |============================================================*/
 #include <stdlib.h>
+#include <time.h>
+#include <ctype.h>
 #include "util.h"
 #include "arr.h"
 
 /*=====| FUNCTIONS |==========================================================*/
 /** Fill the given array with float numbers between 0 and 1.
  *
- * @note You must run srand() before in order to initialize the random number
- *  generation seed.
  * @note The array 'arr' size must be 'size'.
  *
- * @param[out] arr  The array to fill.
- * @param[in]  size The number of value to add to the array.
+ * @param[out]    arr  The array to fill.
+ * @param[in]     size The number of value to add to the array.
+ * @param[in,out] seed The state of the random number generator. Each thread
+ *  must use its own.
  */
-void random_sample(float *arr, size_t size){
+void random_sample(float *arr, size_t size, unsigned int *seed){
     size_t i;
 
     for(i = 0; i < size; i++){
-        arr[i] = (float)rand() / (float)(RAND_MAX / 1);
+        arr[i] = (float)rand_r(seed) / (float)(RAND_MAX / 1);
     }
 }
 
 /** Returns a randomly generated integer between 0 and the given maximum.
  *
- * @param[in] max The maximum boundary.
+ * @param[in]     max  The maximum boundary.
+ * @param[in,out] seed The state of the random number generator. Each thread
+ *  must use its own.
  *
  * @return The randomly generated number.
  */
-unsigned int random_uint (unsigned int max){
-    return (unsigned int)rand() % max;
+unsigned int random_uint (unsigned int max, unsigned int *seed){
+    return (unsigned int)rand_r(seed) % max;
 }
 
 /** Determine the extension (format) of a file.
@@ -50,3 +54,53 @@ const char *get_filename_ext(const char *filename){
     if(!dot || dot == filename) return "";
     return dot + 1;
 }
+
+/** Returns the time elapsed since an arbitrary point, in milliseconds.
+ *
+ * The clock is monotonic: it is not affected by changes of the system time so
+ * it can be used to measure durations.
+ *
+ * @return The current time in milliseconds.
+ */
+double now_ms(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000. + ts.tv_nsec / 1000000.;
+}
+
+/** Parse a size in bytes.
+ *
+ * The number can be followed by a K, M or G suffix (powers of 1024), e.g.
+ * "512M".
+ *
+ * @param[in] str The string to parse.
+ *
+ * @return The size in bytes or 0 if the string is not a valid size.
+ */
+size_t parse_size(const char *str){
+    char *end;
+    double val = strtod(str, &end);
+
+    if(end == str || val <= 0){
+        return 0;
+    }
+    switch(toupper((unsigned char)*end)){
+        case 'G':
+            val *= 1024;
+            /* fall through */
+        case 'M':
+            val *= 1024;
+            /* fall through */
+        case 'K':
+            val *= 1024;
+            end++;
+            break;
+        default:
+            break;
+    }
+    if(*end != '\0' && toupper((unsigned char)*end) != 'B'){
+        return 0;
+    }
+    return (size_t)val;
+}
@@ -9,10 +9,16 @@
         ({ __typeof__ (a) _a = (a); \
         __typeof__ (b) _b = (b); \
         _a > _b ? _a : _b; })
+#define min(a,b) \
+        ({ __typeof__ (a) _a = (a); \
+        __typeof__ (b) _b = (b); \
+        _a < _b ? _a : _b; })
 
 /*====| PROTOTYPES |==========================================================*/
-void random_sample(float *arr, size_t size);
-unsigned int random_uint (unsigned int max);
+void random_sample(float *arr, size_t size, unsigned int *seed);
+unsigned int random_uint (unsigned int max, unsigned int *seed);
 const char *get_filename_ext(const char *filename);
+double now_ms(void);
+size_t parse_size(const char *str);
 
 #endif
\ No newline at end of file
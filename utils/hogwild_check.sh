@@ -0,0 +1,66 @@
+#!/bin/sh
+# Check that a Hogwild training (--hogwild) keeps the quality of a serial
+# training and report its throughput scaling.
+#
+# usage: hogwild_check.sh posternn image [level] [epochs] [threads] [runs]
+#
+# Each configuration (serial, then each number of threads of the 'threads'
+# list) trains 'runs' palettes of the image without any early stop. The
+# script prints the mean quantization error, the iterations per millisecond
+# and the speedup over the serial training of each one, and fails if a mean
+# error is more than HOGWILD_TOLERANCE (default 5) percent above the serial
+# one. Only the training is timed (the time posternn prints), not the loading
+# and posterization of the image. The speedup is only reported: it depends on
+# the number of processors.
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 posternn image [level] [epochs] [threads] [runs]" >&2
+    exit 2
+fi
+bin=$1
+img=$2
+level=${3:-8}
+epochs=${4:-200000}
+threads=${5:-"2 4"}
+runs=${6:-5}
+tolerance=${HOGWILD_TOLERANCE:-5}
+tmp=$(mktemp -d) || exit 2
+trap 'rm -rf "$tmp"' EXIT
+
+number='\([0-9.]*\)'
+
+# Train 'runs' palettes, print the mean error and training time (ms) per run
+measure(){
+    : > "$tmp/runs"
+    i=0
+    while [ $i -lt "$runs" ]; do
+        "$bin" -i "$img" -o "$tmp/out.ppm" -l "$level" -e "$epochs" -t 0 \
+            -p 0 --no-display "$@" > "$tmp/log" 2>&1 || 
+            { cat "$tmp/log" >&2; exit 1; }
+        sed -n "s/.* in $number ms (quantization error: $number).*/\\2 \\1/p" \
+            "$tmp/log" >> "$tmp/runs"
+        i=$((i + 1))
+    done
+    awk '{ err += $1; ms += $2 } END { printf "%f %f\n", err / NR, ms / NR }' \
+        "$tmp/runs"
+}
+
+result=$(measure) || exit 1
+set -- $result
+serialErr=$1
+serialMs=$2
+printf "serial     error %f  %8.1f it/ms\n" "$serialErr" \
+    "$(echo "$epochs $serialMs" | awk '{ print $1 / $2 }')"
+
+status=0
+for n in $threads; do
+    result=$(measure --hogwild "$n") || exit 1
+    set -- $result
+    echo "$n $1 $2 $serialErr $serialMs $epochs $tolerance" | awk '{
+        printf "%2d threads error %f  %8.1f it/ms  speedup %.2f\n",
+               $1, $2, $6 / $3, $5 / $3
+        exit ($2 > $4 * (1 + $7 / 100))
+    }' || { echo "error above the serial one by more than $tolerance%" >&2
+            status=1; }
+done
+exit $status
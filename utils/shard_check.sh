@@ -0,0 +1,59 @@
+#!/bin/sh
+# Check that a sharded training (--shard, --merge, --palette) keeps the
+# quality of a single process training.
+#
+# usage: shard_check.sh posternn image [level] [epochs] [shards]
+#
+# The 'shards' processes train their band of the image concurrently, their
+# shard files are merged into a palette and the image is posterized with it.
+# The script prints the quantization error of that palette and of a single
+# process training of the whole image, and fails if the sharded one is more
+# than SHARD_TOLERANCE (default 10) percent above the other.
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 posternn image [level] [epochs] [shards]" >&2
+    exit 2
+fi
+bin=$1
+img=$2
+level=${3:-8}
+epochs=${4:-20000}
+shards=${5:-4}
+tolerance=${SHARD_TOLERANCE:-10}
+tmp=$(mktemp -d) || exit 2
+trap 'rm -rf "$tmp"' EXIT
+
+# Run posternn with its messages in the log, print them if it fails
+run(){
+    "$bin" "$@" > "$tmp/log" 2>&1 || { cat "$tmp/log" >&2; exit 1; }
+}
+
+# Print the last quantization error of the log
+qerror(){
+    sed -n 's/.*quantization error: \([0-9.]*\).*/\1/p' "$tmp/log" | tail -n 1
+}
+
+i=0
+pids=""
+while [ $i -lt "$shards" ]; do
+    "$bin" -i "$img" -l "$level" -e "$epochs" --shard "$i/$shards" \
+        -o "$tmp/shard$i.pal" > "$tmp/shard$i.log" 2>&1 &
+    pids="$pids $!"
+    i=$((i + 1))
+done
+i=0
+for pid in $pids; do
+    wait "$pid" || { cat "$tmp/shard$i.log" >&2; exit 1; }
+    i=$((i + 1))
+done
+run --merge -l "$level" -e "$epochs" -o "$tmp/merged.pal" "$tmp"/shard*.pal
+run -i "$img" --palette "$tmp/merged.pal" -o "$tmp/sharded.ppm" --no-display
+shardedErr=$(qerror)
+run -i "$img" -l "$level" -e "$epochs" -o "$tmp/single.ppm" --no-display
+singleErr=$(qerror)
+
+echo "$shards $shardedErr $singleErr $tolerance" | awk '{
+    printf "single process error %f\n%2d shards      error %f\n", $3, $1, $2
+    exit ($2 > $3 * (1 + $4 / 100))
+}' || { echo "error above the single process one by more than" \
+             "$tolerance%" >&2; exit 1; }